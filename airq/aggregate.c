@@ -0,0 +1,225 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * Rolling statistics over the last minute, 15 minutes and hour of every
+ * sensor. Each window keeps the samples it covers in a ring, a running sum
+ * for the mean, two monotonic deques for minimum and maximum and a log
+ * bucket histogram for percentiles. Adding a sample and dropping the ones
+ * that left the window is O(1) amortized, the history is never rescanned.
+ * All state belongs to the network thread.
+ */
+
+const time_t airq_aggregate_spans[AIRQ_WINDOWS] = { 60, 15 * 60, 60 * 60 };
+
+/* percentile sketch: buckets grow by SKETCH_GAMMA, i.e. a relative error of about 5% */
+#define SKETCH_GAMMA 1.1
+#define SKETCH_MIN 0.01             /* smaller magnitudes share the zero bucket */
+#define SKETCH_HALF 170             /* buckets per sign, up to SKETCH_MIN * SKETCH_GAMMA^SKETCH_HALF ~ 1e5 */
+#define SKETCH_BUCKETS (2 * SKETCH_HALF + 1)
+
+static int sketch_bucket(double value) {
+  double a = fabs(value);
+
+  if (a < SKETCH_MIN) {
+    return SKETCH_HALF;
+  }
+  int k = (int) ceil(log(a / SKETCH_MIN) / log(SKETCH_GAMMA));
+  if (k < 1) {
+    k = 1;
+  } else if (k > SKETCH_HALF) {
+    k = SKETCH_HALF;
+  }
+  return value < 0 ? SKETCH_HALF - k : SKETCH_HALF + k;
+}
+
+/* geometric middle of a bucket */
+static double sketch_value(int bucket) {
+  int k = bucket - SKETCH_HALF;
+
+  if (k == 0) {
+    return 0;
+  }
+  double a = SKETCH_MIN * pow(SKETCH_GAMMA, abs(k) - 0.5);
+  return k < 0 ? -a : a;
+}
+
+static int window_init(airq_window_t* w, time_t span, uint32_t capacity) {
+  size_t size = capacity * (sizeof(time_t) + sizeof(double) + 2 * sizeof(uint32_t)) + SKETCH_BUCKETS * sizeof(uint16_t);
+  char* block = calloc(1, size);
+
+  if (block == NULL) {
+    return AIRQ_OUT_OF_MEMORY;
+  }
+  memset(w, 0, sizeof(airq_window_t));
+  w->span = span;
+  w->capacity = capacity;
+  w->time = (time_t*) block;
+  w->value = (double*) (w->time + capacity);
+  w->min_q = (uint32_t*) (w->value + capacity);
+  w->max_q = w->min_q + capacity;
+  w->buckets = (uint16_t*) (w->max_q + capacity);
+  return AIRQ_OK;
+}
+
+/* drop the oldest sample of the window */
+static void window_evict(airq_window_t* w) {
+  uint32_t seq = w->next - w->count;
+  uint32_t i = seq % w->capacity;
+
+  w->sum -= w->value[i];
+  w->buckets[sketch_bucket(w->value[i])]--;
+  if (w->min_len > 0 && w->min_q[w->min_head] == seq) {
+    w->min_head = (w->min_head + 1) % w->capacity;
+    w->min_len--;
+  }
+  if (w->max_len > 0 && w->max_q[w->max_head] == seq) {
+    w->max_head = (w->max_head + 1) % w->capacity;
+    w->max_len--;
+  }
+  if (--w->count == 0) {
+    w->sum = 0;                 /* no rounding residue survives an empty window */
+  }
+}
+
+static void window_expire(airq_window_t* w, time_t now) {
+  while (w->count > 0 && w->time[(w->next - w->count) % w->capacity] <= now - w->span) {
+    window_evict(w);
+  }
+}
+
+/* append seq to a monotonic deque after dropping the entries it dominates */
+static void deque_push(airq_window_t* w, uint32_t* q, uint32_t head, uint32_t* len, double value, int sign) {
+  while (*len > 0) {
+    uint32_t back = q[(head + *len - 1) % w->capacity];
+    if (sign * (value - w->value[back % w->capacity]) < 0) {
+      break;
+    }
+    (*len)--;
+  }
+  q[(head + *len) % w->capacity] = w->next;
+  (*len)++;
+}
+
+static void window_add(airq_window_t* w, time_t time, double value) {
+  window_expire(w, time);
+  if (w->count == w->capacity) {
+    window_evict(w);
+  }
+
+  uint32_t i = w->next % w->capacity;
+  w->time[i] = time;
+  w->value[i] = value;
+  w->sum += value;
+  w->buckets[sketch_bucket(value)]++;
+
+  /* the minimum deque keeps ascending values, the maximum deque descending ones */
+  deque_push(w, w->min_q, w->min_head, &w->min_len, value, -1);
+  deque_push(w, w->max_q, w->max_head, &w->max_len, value, 1);
+
+  w->next++;
+  w->count++;
+}
+
+int airq_aggregate_init(airq_device_t* device) {
+  time_t interval = g_reload_values;
+
+  /* size the windows for the shortest poll interval that is configured */
+  if (g_reload_values_min > 0 && g_reload_values_min < interval) {
+    interval = g_reload_values_min;
+  }
+  if (interval < 1) {
+    interval = 1;
+  }
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    for (int k = 0; k < AIRQ_WINDOWS; k++) {
+      uint32_t capacity = airq_aggregate_spans[k] / interval + 2;
+      if (capacity > UINT16_MAX) {
+        capacity = UINT16_MAX;
+      }
+      if (window_init(&device->sensor_values[i].windows[k], airq_aggregate_spans[k], capacity) != AIRQ_OK) {
+        airq_aggregate_free(device);
+        return AIRQ_OUT_OF_MEMORY;
+      }
+    }
+  }
+  return AIRQ_OK;
+}
+
+void airq_aggregate_free(airq_device_t* device) {
+  for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
+    for (int k = 0; k < AIRQ_WINDOWS; k++) {
+      free(device->sensor_values[i].windows[k].time);
+      memset(&device->sensor_values[i].windows[k], 0, sizeof(airq_window_t));
+    }
+  }
+}
+
+void airq_aggregate_add(sensor_value_t* svalue, time_t time, double value) {
+  for (int k = 0; k < AIRQ_WINDOWS; k++) {
+    if (svalue->windows[k].capacity > 0) {
+      window_add(&svalue->windows[k], time, value);
+    }
+  }
+}
+
+static double window_percentile(const airq_window_t* w, double p) {
+  uint32_t rank = (uint32_t) ceil(p * w->count);
+  uint32_t seen = 0;
+
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (int b = 0; b < SKETCH_BUCKETS; b++) {
+    seen += w->buckets[b];
+    if (seen >= rank) {
+      return sketch_value(b);
+    }
+  }
+  return 0;
+}
+
+/* statistics of window k as of now, samples older than the window are dropped first */
+int airq_aggregate_get(sensor_value_t* svalue, int k, time_t now, airq_stats_t* stats) {
+  airq_window_t* w = &svalue->windows[k];
+
+  memset(stats, 0, sizeof(airq_stats_t));
+  if (w->capacity == 0) {
+    return AIRQ_BAD_CONFIG;
+  }
+
+  window_expire(w, now);
+  stats->count = w->count;
+  if (w->count == 0) {
+    return AIRQ_OK;
+  }
+
+  stats->min = w->value[w->min_q[w->min_head] % w->capacity];
+  stats->max = w->value[w->max_q[w->max_head] % w->capacity];
+  stats->mean = w->sum / w->count;
+
+  /* bucket values are approximations, keep them inside the exact range */
+  double p[3] = { 0.5, 0.9, 0.95 };
+  double* out[3] = { &stats->p50, &stats->p90, &stats->p95 };
+  for (int i = 0; i < 3; i++) {
+    double v = window_percentile(w, p[i]);
+    *out[i] = v < stats->min ? stats->min : (v > stats->max ? stats->max : v);
+  }
+  return AIRQ_OK;
+}
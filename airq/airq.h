@@ -9,11 +9,120 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <stdatomic.h>
 
+#include <curl/curl.h>
+#include <openssl/evp.h>
 #include <digitalSTROM/dsuid.h>
 #include <dsvdc/dsvdc.h>
 
 #define MAX_SENSOR_VALUES 20
+#define AIRQ_STREAM_WINDOW 512
+#define DEFAULT_PUSH_INTERVAL 5
+#define DEFAULT_ALIVE_SIGN_INTERVAL 300
+#define DEFAULT_HISTORY_SIZE 1440
+#define AIRQ_WINDOWS 3              /* aggregation windows: 1 min, 15 min, 1 h */
+
+/* retries of a failing device back off exponentially between these bounds, in seconds */
+#define RETRY_DELAY_MIN 10
+#define RETRY_DELAY_MAX 900
+/* consecutive failures after which the device is reported as not present */
+#define BREAKER_THRESHOLD 5
+
+/* AirQ data keys with a compile time index, see sensor_keys.gperf */
+enum {
+  AIRQ_KEY_CO2,
+  AIRQ_KEY_CO,
+  AIRQ_KEY_TEMPERATURE,
+  AIRQ_KEY_HUMIDITY,
+  AIRQ_KEY_HUMIDITY_ABS,
+  AIRQ_KEY_DEWPT,
+  AIRQ_KEY_PRESSURE,
+  AIRQ_KEY_PRESSURE_REL,
+  AIRQ_KEY_PM1,
+  AIRQ_KEY_PM2_5,
+  AIRQ_KEY_PM10,
+  AIRQ_KEY_CNT0_3,
+  AIRQ_KEY_CNT0_5,
+  AIRQ_KEY_CNT1,
+  AIRQ_KEY_CNT2_5,
+  AIRQ_KEY_CNT5,
+  AIRQ_KEY_CNT10,
+  AIRQ_KEY_TYPPS,
+  AIRQ_KEY_SOUND,
+  AIRQ_KEY_SOUND_MAX,
+  AIRQ_KEY_NO2,
+  AIRQ_KEY_SO2,
+  AIRQ_KEY_O3,
+  AIRQ_KEY_H2S,
+  AIRQ_KEY_OXYGEN,
+  AIRQ_KEY_TVOC,
+  AIRQ_KEY_TVOC_IONSC,
+  AIRQ_KEY_CH2O,
+  AIRQ_KEY_RADON,
+  AIRQ_KEY_HEALTH,
+  AIRQ_KEY_PERFORMANCE,
+  AIRQ_KEY_VIRUS,
+  AIRQ_KEY_MOLD,
+  AIRQ_KEY_DCO2DT,
+  AIRQ_KEY_DHDT,
+  AIRQ_KEY_DOOR_EVENT,
+  AIRQ_KEY_TIMESTAMP,
+  AIRQ_KEY_MEASURETIME,
+  AIRQ_KEY_UPTIME,
+  AIRQ_KEY_DEVICEID,
+  AIRQ_KEY_STATUS,
+  AIRQ_KEY_COUNT
+};
+
+/* vdSM property names with a compile time index, see properties.gperf */
+enum {
+  AIRQ_PROP_HARDWARE_GUID,
+  AIRQ_PROP_DISPLAY_ID,
+  AIRQ_PROP_IMPLEMENTATION_ID,
+  AIRQ_PROP_MODEL_GUID,
+  AIRQ_PROP_CAPABILITIES,
+  AIRQ_PROP_PRIMARY_GROUP,
+  AIRQ_PROP_ZONE_ID,
+  AIRQ_PROP_BUTTON_INPUT_DESCRIPTIONS,
+  AIRQ_PROP_BUTTON_INPUT_SETTINGS,
+  AIRQ_PROP_DYNAMIC_ACTION_DESCRIPTIONS,
+  AIRQ_PROP_OUTPUT_DESCRIPTION,
+  AIRQ_PROP_OUTPUT_SETTINGS,
+  AIRQ_PROP_CHANNEL_DESCRIPTIONS,
+  AIRQ_PROP_CHANNEL_SETTINGS,
+  AIRQ_PROP_CHANNEL_STATES,
+  AIRQ_PROP_DEVICE_STATES,
+  AIRQ_PROP_DEVICE_PROPERTIES,
+  AIRQ_PROP_DEVICE_PROPERTY_DESCRIPTIONS,
+  AIRQ_PROP_CUSTOM_ACTIONS,
+  AIRQ_PROP_BINARY_INPUT_DESCRIPTIONS,
+  AIRQ_PROP_BINARY_INPUT_SETTINGS,
+  AIRQ_PROP_BINARY_INPUT_STATES,
+  AIRQ_PROP_SENSOR_DESCRIPTIONS,
+  AIRQ_PROP_SENSOR_SETTINGS,
+  AIRQ_PROP_SENSOR_STATES,
+  AIRQ_PROP_NAME,
+  AIRQ_PROP_TYPE,
+  AIRQ_PROP_MODEL,
+  AIRQ_PROP_MODEL_FEATURES,
+  AIRQ_PROP_MODEL_UID,
+  AIRQ_PROP_MODEL_VERSION,
+  AIRQ_PROP_DEVICE_CLASS,
+  AIRQ_PROP_DEVICE_CLASS_VERSION,
+  AIRQ_PROP_OEM_GUID,
+  AIRQ_PROP_OEM_MODEL_GUID,
+  AIRQ_PROP_VENDOR_ID,
+  AIRQ_PROP_VENDOR_NAME,
+  AIRQ_PROP_VENDOR_GUID,
+  AIRQ_PROP_HARDWARE_VERSION,
+  AIRQ_PROP_CONFIG_URL,
+  AIRQ_PROP_HARDWARE_MODEL_GUID,
+  AIRQ_PROP_DEVICE_ICON16,
+  AIRQ_PROP_DEVICE_ICON48,
+  AIRQ_PROP_DEVICE_ICON_NAME,
+  AIRQ_PROP_COUNT
+};
 
 typedef struct scene {
   int dsId;
@@ -25,30 +134,256 @@ typedef struct scene {
   double currentNoise;
 } scene_t;
 
+/* compressed block of history samples, see history.c */
+#define AIRQ_BLOCK_WORDS 32
+typedef struct airq_history_block {
+  time_t first_time;
+  uint32_t count;
+  uint32_t bits;              /* used bits of data */
+  uint64_t data[AIRQ_BLOCK_WORDS];
+} airq_history_block_t;
+
+/* ring of compressed blocks, the oldest block is dropped when all are in use */
+typedef struct airq_history {
+  airq_history_block_t *blocks;
+  uint32_t nblocks;
+  uint32_t head;              /* block currently written */
+  uint32_t used;              /* blocks holding samples */
+  uint32_t count;             /* samples in all blocks */
+  /* encoder state of the head block */
+  time_t last_time;
+  int64_t last_delta;
+  uint64_t last_bits;
+  int lead;                   /* leading / trailing zero bits of the last XOR window, -1 = none */
+  int trail;
+} airq_history_t;
+
+/* decoder walking the history from the oldest sample */
+typedef struct airq_history_iter {
+  const airq_history_t *h;
+  uint32_t block;
+  uint32_t blocks_left;
+  uint32_t n;                 /* samples read from the current block */
+  uint32_t pos;               /* bit position in the current block */
+  time_t time;
+  int64_t delta;
+  uint64_t bits;
+  int lead;
+  int trail;
+} airq_history_iter_t;
+
+/* rolling aggregation window, see aggregate.c */
+typedef struct airq_window {
+  time_t span;
+  uint32_t capacity;
+  uint32_t next;              /* sequence number of the next sample */
+  uint32_t count;             /* samples inside the window */
+  time_t *time;               /* sample ring, indexed by sequence number % capacity */
+  double *value;
+  uint32_t *min_q;            /* monotonic deques of sequence numbers */
+  uint32_t min_head;
+  uint32_t min_len;
+  uint32_t *max_q;
+  uint32_t max_head;
+  uint32_t max_len;
+  double sum;
+  uint16_t *buckets;          /* log bucket histogram for percentiles */
+} airq_window_t;
+
+typedef struct airq_stats {
+  uint32_t count;
+  double min;
+  double max;
+  double mean;
+  double p50;
+  double p90;
+  double p95;
+} airq_stats_t;
+
 typedef struct sensor_value {
   bool is_active;
   char *value_name;
   int sensor_type;
   int sensor_usage;
+  double deadband_abs;        /* minimum absolute change to count as changed, 0 = off */
+  double deadband_rel;        /* minimum change relative to the reference value, 0 = off */
+  double quantize;            /* values are rounded to multiples of this step, 0 = off */
   double value;
   double last_value;
+  double reference;           /* value of the last significant change */
   time_t last_query;
+  time_t last_appended;       /* last_query of the newest sample in history, aggregates and store */
+  double min_push_interval;   /* minPushInterval in seconds */
+  double changes_only_interval; /* changesOnlyInterval in seconds */
+  double alive_sign_interval; /* aliveSignInterval in seconds, 0 = no heartbeat */
+  /* push state, owned by the main loop */
   time_t last_reported;
+  double last_push_ms;        /* monotonic time of the last push, 0 = never */
+  double last_pushed_value;
+  airq_history_t history;     /* written by the network thread */
+  airq_window_t windows[AIRQ_WINDOWS];
+  uint32_t store_key;         /* hash of value_name in the history store */
+  bool restored;              /* value was restored from the history store and not polled yet */
 } sensor_value_t;
 
+/* published state of one sensor */
+typedef struct sensor_state {
+  double value;
+  time_t last_query;
+} sensor_state_t;
+
+typedef struct airq_snapshot {
+  sensor_state_t values[MAX_SENSOR_VALUES];
+  time_t time;
+  double ready_ms;            /* monotonic time of the publish, in ms */
+} airq_snapshot_t;
+
+/* the last complete poll result, written by the network thread only */
+typedef struct airq_shared {
+  atomic_uint seq;            /* odd while a publish is in progress */
+  airq_snapshot_t snapshot;
+  airq_stats_t stats[MAX_SENSOR_VALUES][AIRQ_WINDOWS];  /* aggregates as of the snapshot */
+  atomic_uint dirty;          /* bitmap of sensor slots changed since the last push */
+  atomic_uint history_seq;    /* odd while the network thread appends to the history */
+} airq_shared_t;
+
+typedef struct airq_connection {
+  CURL *curl;                 /* long-lived handle, keeps the TCP connection and DNS cache */
+  char url[128];
+  bool busy;                  /* handle is attached to the multi handle */
+  atomic_ulong requests;      /* written by the network thread, read by the metrics */
+  atomic_ulong connects;      /* requests that had to open a new connection */
+  atomic_ulong reused;        /* requests served over a kept-alive connection */
+  atomic_ulong errors;
+} airq_connection_t;
+
+enum {
+  AIRQ_STREAM_SCAN,           /* looking for the "content" key */
+  AIRQ_STREAM_COLON,          /* between key and value */
+  AIRQ_STREAM_CONTENT,        /* inside the base64 value */
+  AIRQ_STREAM_DONE,
+  AIRQ_STREAM_ERROR
+};
+
+/* incremental decoder for the encrypted "content" field of a /data response */
+typedef struct airq_stream {
+  int state;
+  int match;                  /* matched characters of the key */
+  uint32_t quad;              /* pending base64 sextets */
+  int quad_len;
+  unsigned char iv[16];
+  int iv_len;
+  EVP_CIPHER_CTX *ctx;        /* holds the key schedule for the lifetime of the device */
+  double decode_ms;           /* time spent in the running response, extraction included */
+  unsigned char cipher[AIRQ_STREAM_WINDOW];   /* decoded ciphertext waiting for decryption */
+  size_t cipher_len;
+  char *plain;                /* decrypted payload in json validation mode, reused for every response */
+  size_t plain_size;
+  size_t plain_len;
+} airq_stream_t;
+
+/* timed stages of a poll and push, see metrics.c */
+enum {
+  AIRQ_STAGE_CONNECT,         /* TCP connect of a request that opened a new connection */
+  AIRQ_STAGE_FIRST_BYTE,      /* request sent until the first response byte */
+  AIRQ_STAGE_TRANSFER,        /* whole request as seen by curl */
+  AIRQ_STAGE_DECODE,          /* base64 and AES of the content */
+  AIRQ_STAGE_PARSE,           /* JSON parsing and change detection */
+  AIRQ_STAGE_PUBLISH,         /* history, aggregates and snapshot */
+  AIRQ_STAGE_PUSH,            /* push_sensor_data() */
+  AIRQ_STAGE_LATENCY,         /* poll result until its push */
+  AIRQ_STAGE_GETPROP,         /* getProperty request of the vdSM */
+  AIRQ_STAGE_COUNT
+};
+
+enum {
+  AIRQ_COUNTER_POLLS,
+  AIRQ_COUNTER_POLL_FAILURES,
+  AIRQ_COUNTER_PUSHES,
+  AIRQ_COUNTER_PUSHED_VALUES,
+  AIRQ_COUNTER_GETPROP,
+  AIRQ_COUNTER_SETPROP,
+  AIRQ_COUNTER_COUNT
+};
+
+/* circuit breaker of a device */
+enum {
+  AIRQ_BREAKER_CLOSED,        /* device answers */
+  AIRQ_BREAKER_OPEN,          /* too many failures, the vdSD is not present */
+  AIRQ_BREAKER_HALF_OPEN      /* a probe poll of an open breaker is running */
+};
+
+enum {
+  AIRQ_WATCH_WAKEUP,
+  AIRQ_WATCH_CURL_TIMER,
+  AIRQ_WATCH_DEVICE,
+  AIRQ_WATCH_SOCKET,
+  AIRQ_WATCH_REMOVED          /* socket curl is done with, freed after the current epoll batch */
+};
+
+/* file descriptor in the network thread's epoll set */
+typedef struct airq_watch {
+  int type;
+  int fd;
+  struct airq_device* device;
+  struct airq_watch* next;    /* list of removed watches */
+} airq_watch_t;
+
+/* state of the streaming sensor value extractor */
+typedef struct airq_extract {
+  int state;
+  char key[32];
+  int key_len;
+  char num[32];
+  int num_len;
+  int depth;                  /* nesting level of a skipped value */
+  sensor_value_t* svalue;     /* configured sensor of the current key */
+  double staged[MAX_SENSOR_VALUES];   /* values of the running response, by sensor slot */
+  uint32_t staged_slots;      /* slots with a staged value */
+  time_t now;
+  double parse_ms;            /* time spent extracting from the running response */
+} airq_extract_t;
+
 typedef struct airq_device {
+  struct airq_device* next;
+  struct airq_vdcd* vdcd;
   dsuid_t dsuid;
   char *id;
   char *name;
   char *ip;
   char *password;
+  unsigned char key[32];      /* AES key derived from the password */
   
   sensor_value_t sensor_values[MAX_SENSOR_VALUES];
+  int8_t sensor_slot[AIRQ_KEY_COUNT];       /* AirQ key -> sensor_values index, -1 if not configured */
+  uint32_t store_id;          /* hash of id in the history store */
+  struct airq_history_block* history_blocks;  /* history blocks of all sensors */
+  bool unindexed_sensors;                   /* some value_name is not a known AirQ key */
   uint16_t zoneID;
+
+  airq_connection_t conn;
+  airq_stream_t stream;
+  airq_extract_t extract;
+  airq_watch_t timer;         /* timerfd of the next poll */
+  time_t query_time;          /* next poll */
+  atomic_uint poll_delay;     /* seconds from the last poll to the next one as scheduled */
+  atomic_bool poll_requested; /* set by airq_network_poll_now() in other threads */
+
+  uint32_t dirty;             /* slots changed by the running poll, network thread only */
+  airq_shared_t shared;
+  double poll_interval;       /* current poll interval in seconds, network thread only */
+  unsigned int failures;      /* consecutive failed polls, network thread only */
+  atomic_int breaker;         /* AIRQ_BREAKER_* */
+  uint32_t push_pending;      /* changed slots waiting for their push window, main loop only */
+  uint32_t alive_pending;     /* slots due for an alive sign, never dropped as unchanged, main loop only */
+  double next_alive_ms;       /* next alive sign deadline of any slot, main loop only */
+  double push_latency_ms;     /* time from poll result to push of the last values */
+  double push_latency_max_ms;
 } airq_device_t;
 
 typedef struct airq_data {
-  airq_device_t device;
+  airq_device_t* devices;
+  int count;
 } airq_data_t;
 
 typedef struct airq_vdcd {
@@ -57,7 +392,7 @@ typedef struct airq_vdcd {
   char dsuidstring[36];
   bool announced;
   bool presentSignaled;
-  bool present;
+  atomic_bool present;        /* cleared by the network thread while the device is unreachable */
   airq_device_t* device;
 } airq_vdcd_t;
 
@@ -71,8 +406,7 @@ typedef struct airq_vdcd {
 extern const char *g_cfgfile;
 extern int g_shutdown_flag;
 extern airq_data_t airq;
-extern airq_vdcd_t* airq_device;
-extern pthread_mutex_t g_network_mutex;
+extern airq_vdcd_t* airq_devices;
 extern scene_t* airq_current_values;
 
 extern char g_vdc_modeluid[33];
@@ -80,7 +414,16 @@ extern char g_vdc_dsuid[35];
 extern char g_lib_dsuid[35];
 
 extern time_t g_reload_values;
+extern time_t g_reload_values_min;
+extern time_t g_reload_values_max;
+extern long g_connect_timeout;
+extern uint32_t g_history_size;
+extern char* g_history_file;
+extern char* g_query_socket;
+extern char* g_metrics_file;
+extern long g_request_timeout;
 extern int g_default_zoneID;
+extern bool g_json_validation;
 
 extern void vdc_new_session_cb(dsvdc_t *handle __attribute__((unused)), void *userdata);
 extern void vdc_ping_cb(dsvdc_t *handle __attribute__((unused)), const char *dsuid, void *userdata __attribute__((unused)));
@@ -95,10 +438,67 @@ extern void vdc_callscene_cb(dsvdc_t *handle __attribute__((unused)), char **dsu
 extern void vdc_savescene_cb(dsvdc_t *handle __attribute__((unused)), char **dsuid, size_t n_dsuid, int32_t scene, int32_t *group, int32_t *zone_id, void *userdata);
 extern void vdc_request_generic_cb(dsvdc_t *handle __attribute__((unused)), char *dsuid, char *method_name, dsvdc_property_t *property, const dsvdc_property_t *properties,  void *userdata);
 
-int airq_get_values();
-void push_sensor_data();
+int airq_network_init();
+void airq_network_cleanup();
+void airq_network_run();
+void airq_network_schedule(airq_device_t* device, time_t delay);
+void airq_network_wakeup();
+void airq_network_poll_now(airq_device_t* device);
+void airq_network_poll_all();
+void airq_values_received(airq_device_t* device, int rc);
+void airq_notify_main();
+int airq_history_init(airq_device_t* device, uint32_t capacity);
+void airq_history_free(airq_device_t* device);
+void airq_history_add(airq_history_t* h, time_t time, double value);
+void airq_history_append(airq_device_t* device);
+void airq_history_iter_init(airq_history_iter_t* it, const airq_history_t* h);
+bool airq_history_next(airq_history_iter_t* it, time_t* time, double* value);
+double airq_history_bytes_per_sample(const airq_history_t* h);
+
+extern const time_t airq_aggregate_spans[AIRQ_WINDOWS];
+int airq_aggregate_init(airq_device_t* device);
+void airq_aggregate_free(airq_device_t* device);
+void airq_aggregate_add(sensor_value_t* svalue, time_t time, double value);
+int airq_aggregate_get(sensor_value_t* svalue, int k, time_t now, airq_stats_t* stats);
+
+void airq_metrics_observe(int stage, double ms);
+void airq_metrics_count(int counter, unsigned long n);
+char* airq_metrics_render(size_t* len);
+void airq_metrics_export();
+
+int airq_query_start();
+void airq_query_stop();
+
+int airq_store_open();
+void airq_store_append(airq_device_t* device, sensor_value_t* svalue, time_t time, double value);
+void airq_store_sync();
+void airq_store_close();
+
+void airq_snapshot_publish(airq_device_t* device);
+void airq_snapshot_read(airq_device_t* device, airq_snapshot_t* snapshot);
+uint32_t airq_snapshot_take_dirty(airq_device_t* device);
+void airq_stats_read(airq_device_t* device, int slot, int k, airq_stats_t* stats);
+void push_sensor_data(airq_vdcd_t* vdcd, const airq_snapshot_t* snapshot, uint32_t slots);
 int decodeURIComponent (char *sSource, char *sDest);
-sensor_value_t* find_sensor_value_by_name(char *key);
+int parse_json_data(airq_device_t* device, unsigned char* response);
+
+int airq_stream_init(airq_device_t* device);
+void airq_stream_begin(airq_device_t* device);
+size_t airq_stream_feed(airq_device_t* device, const char *data, size_t len);
+int airq_stream_end(airq_device_t* device);
+
+bool sensor_value_update(airq_device_t* device, sensor_value_t* svalue, double value, time_t now);
+void airq_extract_begin(airq_device_t* device);
+void airq_extract_feed(airq_device_t* device, const char *data, size_t len);
+int airq_extract_end(airq_device_t* device);
+void airq_stream_free(airq_device_t* device);
+sensor_value_t* find_sensor_value_by_name(airq_device_t* device, const char *key);
+airq_vdcd_t* find_vdcd_by_dsuid(const char *dsuid);
+int airq_key_id(const char *key);
+int airq_property_id(const char *name);
+/* airq_property_dispatch() result for a wildcard query of the vDC, its answer ends there */
+#define AIRQ_PROP_STOP -2
+int airq_property_dispatch(const char *name, bool vdc);
 
 int write_config();
 int read_config();
@@ -106,5 +506,30 @@ int read_config();
 void vdc_init_report();
 void vdc_set_debugLevel(int debug);
 int vdc_get_debugLevel();
-void vdc_report(int errlevel, const char *fmt, ... );
-void vdc_report_extraLevel(int errlevel, int maxErrlevel, const char *fmt, ... );
+double vdc_monotonic_ms();
+void vdc_log(const char *fmt, ... ) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Messages above AIRQ_LOG_LEVEL (configure --with-log-level) are compiled
+ * out, the others are checked against the level before any argument of the
+ * message is evaluated.
+ */
+#ifndef AIRQ_LOG_LEVEL
+#define AIRQ_LOG_LEVEL LOG_DEBUG
+#endif
+
+extern int g_debug_level;
+
+#define vdc_report(errlevel, ...) \
+  do { \
+    if ((errlevel) <= AIRQ_LOG_LEVEL && (errlevel) <= g_debug_level) { \
+      vdc_log(__VA_ARGS__); \
+    } \
+  } while (0)
+
+#define vdc_report_extraLevel(errlevel, maxErrlevel, ...) \
+  do { \
+    if ((errlevel) <= AIRQ_LOG_LEVEL && (errlevel) <= (maxErrlevel)) { \
+      vdc_log(__VA_ARGS__); \
+    } \
+  } while (0)
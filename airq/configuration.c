@@ -15,16 +15,202 @@
 #include <libconfig.h>
 #include <utlist.h>
 #include <limits.h>
+#include <ctype.h>
 
 #include <digitalSTROM/dsuid.h>
 #include <dsvdc/dsvdc.h>
 
 #include "airq.h"
 
+static void read_sensor_values(config_setting_t* sensors, airq_device_t* device) {
+  config_setting_t* s;
+  const char *sval;
+  int ivalue;
+  double dvalue;
+  char path[32];
+  int i = 0;
+
+  while(1) {
+    sprintf(path, "s%d", i);
+    if (i < MAX_SENSOR_VALUES && sensors != NULL && (s = config_setting_get_member(sensors, path)) != NULL) {
+      sensor_value_t* value = &device->sensor_values[i];
+      
+      if (config_setting_lookup_string(s, "value_name", &sval)) {
+        value->value_name = strdup(sval);  
+      } else {
+        value->value_name = strdup("");  
+      }
+      
+      if (config_setting_lookup_int(s, "sensor_type", &ivalue))
+        value->sensor_type = ivalue;  
+      
+      if (config_setting_lookup_int(s, "sensor_usage", &ivalue))
+        value->sensor_usage = ivalue;  
+
+      if (config_setting_lookup_float(s, "deadband_abs", &dvalue))
+        value->deadband_abs = dvalue;
+
+      if (config_setting_lookup_float(s, "deadband_rel", &dvalue))
+        value->deadband_rel = dvalue;
+
+      if (config_setting_lookup_float(s, "quantize", &dvalue))
+        value->quantize = dvalue;
+
+      value->min_push_interval = DEFAULT_PUSH_INTERVAL;
+      if (config_setting_lookup_float(s, "min_push_interval", &dvalue))
+        value->min_push_interval = dvalue;
+
+      value->changes_only_interval = DEFAULT_PUSH_INTERVAL;
+      if (config_setting_lookup_float(s, "changes_only_interval", &dvalue))
+        value->changes_only_interval = dvalue;
+
+      value->alive_sign_interval = DEFAULT_ALIVE_SIGN_INTERVAL;
+      if (config_setting_lookup_float(s, "alive_sign_interval", &dvalue))
+        value->alive_sign_interval = dvalue;
+      
+      value->is_active = true;
+      
+      i++;
+    } else {
+      while (i < MAX_SENSOR_VALUES) {
+        device->sensor_values[i].is_active = false;
+        i++;
+      }        
+      break;
+    }
+  }
+}
+
+/* resolve the configured value names to sensor slots once */
+static void index_sensor_values(airq_device_t* device) {
+  memset(device->sensor_slot, -1, sizeof(device->sensor_slot));
+  device->unindexed_sensors = false;
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    int id = airq_key_id(device->sensor_values[i].value_name);
+    if (id < 0) {
+      vdc_report(LOG_NOTICE, "value %s of %s is not a known AirQ key\n", device->sensor_values[i].value_name, device->id);
+      device->unindexed_sensors = true;
+    } else if (device->sensor_slot[id] < 0) {
+      device->sensor_slot[id] = i;
+    }
+  }
+}
+
+static airq_device_t* read_device(config_setting_t* setting, config_setting_t* default_sensors) {
+  airq_device_t* device;
+  const char *sval;
+
+  device = malloc(sizeof(airq_device_t));
+  if (!device) {
+    return NULL;
+  }
+  memset(device, 0, sizeof(airq_device_t));
+  device->timer.fd = -1;
+
+  if (config_setting_lookup_string(setting, "name", &sval))
+    device->name = strdup(sval);
+  if (config_setting_lookup_string(setting, "id", &sval)) {
+    device->id = strdup(sval);
+  } else {
+    vdc_report(LOG_ERR, "mandatory parameter 'id' in section airq: is not set in airq.cfg\n");  
+    exit(0);
+  }
+  if (config_setting_lookup_string(setting, "ip", &sval)) {
+    device->ip = strdup(sval);
+  } else {
+    vdc_report(LOG_ERR, "mandatory parameter 'ip' is not set for %s in airq.cfg\n", device->id);  
+    exit(0);
+  }  
+  if (config_setting_lookup_string(setting, "password", &sval)) {
+    device->password = strdup(sval);
+  } else {
+    vdc_report(LOG_ERR, "mandatory parameter 'password' is not set for %s in airq.cfg\n", device->id);  
+    exit(0);
+  }
+
+  if (airq_stream_init(device) != AIRQ_OK) {
+    vdc_report(LOG_ERR, "cannot prepare decryption for %s\n", device->id);
+    exit(0);
+  }
+
+  /* a device may bring its own sensor list, otherwise the global one applies */
+  config_setting_t* sensors = config_setting_get_member(setting, "sensor_values");
+  read_sensor_values(sensors ? sensors : default_sensors, device);
+  index_sensor_values(device);
+
+  if (airq_history_init(device, g_history_size) != AIRQ_OK || airq_aggregate_init(device) != AIRQ_OK) {
+    vdc_report(LOG_ERR, "cannot allocate the value history for %s\n", device->id);
+    exit(0);
+  }
+
+  return device;
+}
+
+/*
+ * dsUID -> vdSD index, open addressing with linear probing. It is built once
+ * after reading the configuration and stays read-only afterwards.
+ */
+static airq_vdcd_t** vdcd_index = NULL;
+static size_t vdcd_index_mask = 0;
+
+static size_t dsuid_hash(const char *dsuid) {
+  size_t hash = 2166136261u;
+  for (; *dsuid; dsuid++) {
+    hash = (hash ^ (unsigned char) toupper((unsigned char) *dsuid)) * 16777619u;
+  }
+  return hash;
+}
+
+static int build_vdcd_index() {
+  airq_vdcd_t* vdcd;
+  size_t size = 4;
+
+  while (size < (size_t) airq.count * 2) {
+    size <<= 1;
+  }
+
+  free(vdcd_index);
+  vdcd_index = calloc(size, sizeof(airq_vdcd_t*));
+  if (!vdcd_index) {
+    return AIRQ_OUT_OF_MEMORY;
+  }
+  vdcd_index_mask = size - 1;
+
+  LL_FOREACH(airq_devices, vdcd) {
+    size_t slot = dsuid_hash(vdcd->dsuidstring) & vdcd_index_mask;
+    while (vdcd_index[slot] != NULL) {
+      if (strcasecmp(vdcd_index[slot]->dsuidstring, vdcd->dsuidstring) == 0) {
+        vdc_report(LOG_ERR, "device id %s is configured more than once in airq.cfg\n", vdcd->device->id);
+        return AIRQ_BAD_CONFIG;
+      }
+      slot = (slot + 1) & vdcd_index_mask;
+    }
+    vdcd_index[slot] = vdcd;
+  }
+
+  return AIRQ_OK;
+}
+
+airq_vdcd_t* find_vdcd_by_dsuid(const char *dsuid) {
+  if (vdcd_index == NULL || dsuid == NULL) {
+    return NULL;
+  }
+
+  size_t slot = dsuid_hash(dsuid) & vdcd_index_mask;
+  while (vdcd_index[slot] != NULL) {
+    if (strcasecmp(vdcd_index[slot]->dsuidstring, dsuid) == 0) {
+      return vdcd_index[slot];
+    }
+    slot = (slot + 1) & vdcd_index_mask;
+  }
+
+  return NULL;
+}
+
 int read_config() {
   config_t config;
   struct stat statbuf;
-  int i;
   char *sval;
   int ivalue;
 
@@ -38,6 +224,8 @@ int read_config() {
   }
 
   config_init(&config);
+  /* sensor intervals and deadbands are floats, but may be written as integers */
+  config_set_auto_convert(&config, CONFIG_TRUE);
   if (!config_read_file(&config, g_cfgfile)) {
     vdc_report(LOG_ERR, "Error in configuration: l.%d %s\n", config_error_line(&config), config_error_text(&config));
     config_destroy(&config);
@@ -50,92 +238,168 @@ int read_config() {
     strncpy(g_lib_dsuid, sval, sizeof(g_lib_dsuid));
   if (config_lookup_int(&config, "reload_values", (int *) &ivalue))
     g_reload_values = ivalue;
+  if (config_lookup_int(&config, "reload_values_min", (int *) &ivalue))
+    g_reload_values_min = ivalue;
+  if (config_lookup_int(&config, "reload_values_max", (int *) &ivalue))
+    g_reload_values_max = ivalue;
+  if (config_lookup_int(&config, "connect_timeout", (int *) &ivalue))
+    g_connect_timeout = ivalue;
+  if (config_lookup_int(&config, "request_timeout", (int *) &ivalue))
+    g_request_timeout = ivalue;
+  if (config_lookup_int(&config, "history_size", (int *) &ivalue) && ivalue >= 0)
+    g_history_size = ivalue;
+  if (config_lookup_string(&config, "history_file", (const char **) &sval))
+    g_history_file = strdup(sval);
+  if (config_lookup_string(&config, "query_socket", (const char **) &sval))
+    g_query_socket = strdup(sval);
+  if (config_lookup_string(&config, "metrics_file", (const char **) &sval))
+    g_metrics_file = strdup(sval);
   if (config_lookup_int(&config, "zone_id", (int *) &ivalue))
     g_default_zoneID = ivalue;
+  if (config_lookup_bool(&config, "json_validation", &ivalue))
+    g_json_validation = ivalue;
   if (config_lookup_int(&config, "debug", (int *) &ivalue)) {
     if (ivalue <= 10) {
       vdc_set_debugLevel(ivalue);
     }
   }
-  if (config_lookup_string(&config, "airq.name", (const char **) &sval))
-    airq.device.name = strdup(sval);
-  if (config_lookup_string(&config, "airq.id", (const char **) &sval)) {
-    airq.device.id = strdup(sval);
-  } else {
-    vdc_report(LOG_ERR, "mandatory parameter 'id' in section airq: is not set in airq.cfg\n");  
+
+  /* airq is either a single device group or a list of device groups */
+  config_setting_t* default_sensors = config_lookup(&config, "sensor_values");
+  config_setting_t* airq_setting = config_lookup(&config, "airq");
+  if (airq_setting == NULL) {
+    vdc_report(LOG_ERR, "mandatory section airq: is not set in airq.cfg\n");  
     exit(0);
   }
-  if (config_lookup_string(&config, "airq.ip", (const char **) &sval)) {
-    airq.device.ip = strdup(sval);
-  } else {
-    vdc_report(LOG_ERR, "mandatory parameter 'ip' is not set in airq.cfg\n");  
-    exit(0);
-  }  
-  if (config_lookup_string(&config, "airq.password", (const char **) &sval)) {
-    airq.device.password = strdup(sval);
-  } else {
-    vdc_report(LOG_ERR, "mandatory parameter 'password' is not set in airq.cfg\n");  
-    exit(0);
+
+  int n = config_setting_is_list(airq_setting) ? config_setting_length(airq_setting) : 1;
+  for (int i = 0; i < n; i++) {
+    config_setting_t* setting = config_setting_is_list(airq_setting) ? config_setting_get_elem(airq_setting, i) : airq_setting;
+    airq_device_t* device = read_device(setting, default_sensors);
+    if (!device) {
+      config_destroy(&config);
+      return AIRQ_OUT_OF_MEMORY;
+    }
+    LL_APPEND(airq.devices, device);
+    airq.count++;
+  }
+
+  if (g_cfgfile != NULL) {
+    config_destroy(&config);
   }
- 
-  char path[128];  
+
+  airq_device_t* device;
+  LL_FOREACH(airq.devices, device) {
+    airq_vdcd_t* vdcd = malloc(sizeof(airq_vdcd_t));
+    if (!vdcd) {
+      return AIRQ_OUT_OF_MEMORY;
+    }
+    memset(vdcd, 0, sizeof(airq_vdcd_t));
+
+    vdcd->announced = false;
+    vdcd->present = true; 
+    vdcd->device = device;
+    device->vdcd = vdcd;
+
+    dsuid_generate_v3_from_namespace(DSUID_NS_IEEE_MAC, device->id, &vdcd->dsuid);
+    dsuid_to_string(&vdcd->dsuid, vdcd->dsuidstring);
+
+    LL_APPEND(airq_devices, vdcd);
+  }
+
+  return build_vdcd_index();
+}
+
+/* optional sensor parameters are only written when they differ from their default */
+static void write_sensor_float(config_setting_t* sensor, const char* name, double value, double def) {
+  config_setting_t* setting;
+
+  if (value == def) {
+    return;
+  }
+  setting = config_setting_add(sensor, name, CONFIG_TYPE_FLOAT);
+  if (setting == NULL) {
+    setting = config_setting_get_member(sensor, name);
+  }
+  config_setting_set_float(setting, value);
+}
+
+static void write_sensor_values(config_setting_t* parent, airq_device_t* device) {
+  config_setting_t* setting;
+  char path[32];
+  int i;
+
+  config_setting_t *sensor_values_path = config_setting_add(parent, "sensor_values", CONFIG_TYPE_GROUP);
+  if (sensor_values_path == NULL) {
+    sensor_values_path = config_setting_get_member(parent, "sensor_values");
+  }
+  
   i = 0;
   while(1) {
-    sprintf(path, "sensor_values.s%d", i);
-    if (i < MAX_SENSOR_VALUES && config_lookup(&config, path)) {
-      sensor_value_t* value = &airq.device.sensor_values[i];
+    if (i < MAX_SENSOR_VALUES && device->sensor_values[i].value_name != NULL) {
+      sensor_value_t* value = &device->sensor_values[i];
       
-      sprintf(path, "sensor_values.s%d.value_name", i);
-      if (config_lookup_string(&config, path, (const char **) &sval)) {
-        value->value_name = strdup(sval);  
-      } else {
-        value->value_name = strdup("");  
-      }
+      sprintf(path, "s%d", i);   
+      config_setting_t *v = config_setting_add(sensor_values_path, path, CONFIG_TYPE_GROUP);
       
-      sprintf(path, "sensor_values.s%d.sensor_type", i);
-      if (config_lookup_int(&config, path, (int *) &ivalue))
-        value->sensor_type = ivalue;  
+      setting = config_setting_add(v, "value_name", CONFIG_TYPE_STRING);
+      if (setting == NULL) {
+        setting = config_setting_get_member(v, "value_name");
+      }
+      config_setting_set_string(setting, value->value_name);
       
-      sprintf(path, "sensor_values.s%d.sensor_usage", i);
-      if (config_lookup_int(&config, path, (int *) &ivalue))
-        value->sensor_usage = ivalue;  
+      setting = config_setting_add(v, "sensor_type", CONFIG_TYPE_INT);
+      if (setting == NULL) {
+        setting = config_setting_get_member(v, "sensor_type");
+      }
+      config_setting_set_int(setting, value->sensor_type);
       
-      value->is_active = true;
+      setting = config_setting_add(v, "sensor_usage", CONFIG_TYPE_INT);
+      if (setting == NULL) {
+        setting = config_setting_get_member(v, "sensor_usage");
+      }
+      config_setting_set_int(setting, value->sensor_usage);
+
+      write_sensor_float(v, "deadband_abs", value->deadband_abs, 0);
+      write_sensor_float(v, "deadband_rel", value->deadband_rel, 0);
+      write_sensor_float(v, "quantize", value->quantize, 0);
+      write_sensor_float(v, "min_push_interval", value->min_push_interval, DEFAULT_PUSH_INTERVAL);
+      write_sensor_float(v, "changes_only_interval", value->changes_only_interval, DEFAULT_PUSH_INTERVAL);
+      write_sensor_float(v, "alive_sign_interval", value->alive_sign_interval, DEFAULT_ALIVE_SIGN_INTERVAL);
       
       i++;
     } else {
-      while (i < MAX_SENSOR_VALUES) {
-        airq.device.sensor_values[i].is_active = false;
-        i++;
-      }        
       break;
-    }
-  }
-
-  if (g_cfgfile != NULL) {
-    config_destroy(&config);
-  }
-
-  airq_device_t* device = &airq.device;
-  if (device->id) {
-    char buffer[128];
-    strcpy(buffer, device->id);
-    
-    airq_device = malloc(sizeof(airq_vdcd_t));
-    if (!airq_device) {
-      return AIRQ_OUT_OF_MEMORY;
-    }
-    memset(airq_device, 0, sizeof(airq_vdcd_t));
+    }   
+  } 
+}
 
-    airq_device->announced = false;
-    airq_device->present = true; 
-    airq_device->device = device;
+static void write_device(config_setting_t* airqsetting, airq_device_t* device) {
+  config_setting_t* setting;
 
-    dsuid_generate_v3_from_namespace(DSUID_NS_IEEE_MAC, buffer, &airq_device->dsuid);
-    dsuid_to_string(&airq_device->dsuid, airq_device->dsuidstring);
+  setting = config_setting_add(airqsetting, "id", CONFIG_TYPE_STRING);
+  if (setting == NULL) {
+    setting = config_setting_get_member(airqsetting, "id");
   }
+  config_setting_set_string(setting, device->id);
 
-	return 0;
+  setting = config_setting_add(airqsetting, "name", CONFIG_TYPE_STRING);
+  if (setting == NULL) {
+    setting = config_setting_get_member(airqsetting, "name");
+  }
+  config_setting_set_string(setting, device->name);
+  
+  setting = config_setting_add(airqsetting, "ip", CONFIG_TYPE_STRING);
+  if (setting == NULL) {
+    setting = config_setting_get_member(airqsetting, "ip");
+  }
+  config_setting_set_string(setting, device->ip);
+  
+  setting = config_setting_add(airqsetting, "password", CONFIG_TYPE_STRING);
+  if (setting == NULL) {
+    setting = config_setting_get_member(airqsetting, "password");
+  }
+  config_setting_set_string(setting, device->password); 
 }
 
 int write_config() {
@@ -143,7 +407,6 @@ int write_config() {
   config_setting_t* cfg_root;
   config_setting_t* setting;
   config_setting_t* airqsetting;
-  int i;
 
   config_init(&config);
   cfg_root = config_root_setting(&config);
@@ -168,84 +431,95 @@ int write_config() {
   }
   config_setting_set_int(setting, g_reload_values);
 
-  setting = config_setting_add(cfg_root, "zone_id", CONFIG_TYPE_INT);
+  if (g_reload_values_min > 0) {
+    setting = config_setting_add(cfg_root, "reload_values_min", CONFIG_TYPE_INT);
+    if (setting == NULL) {
+      setting = config_setting_get_member(cfg_root, "reload_values_min");
+    }
+    config_setting_set_int(setting, g_reload_values_min);
+  }
+
+  if (g_reload_values_max > 0) {
+    setting = config_setting_add(cfg_root, "reload_values_max", CONFIG_TYPE_INT);
+    if (setting == NULL) {
+      setting = config_setting_get_member(cfg_root, "reload_values_max");
+    }
+    config_setting_set_int(setting, g_reload_values_max);
+  }
+
+  setting = config_setting_add(cfg_root, "connect_timeout", CONFIG_TYPE_INT);
   if (setting == NULL) {
-    setting = config_setting_get_member(cfg_root, "zone_id");
+    setting = config_setting_get_member(cfg_root, "connect_timeout");
   }
-  config_setting_set_int(setting, g_default_zoneID);
+  config_setting_set_int(setting, g_connect_timeout);
 
-  setting = config_setting_add(cfg_root, "debug", CONFIG_TYPE_INT);
+  setting = config_setting_add(cfg_root, "request_timeout", CONFIG_TYPE_INT);
   if (setting == NULL) {
-    setting = config_setting_get_member(cfg_root, "debug");
+    setting = config_setting_get_member(cfg_root, "request_timeout");
   }
-  config_setting_set_int(setting, vdc_get_debugLevel());
+  config_setting_set_int(setting, g_request_timeout);
 
-  airqsetting = config_setting_add(cfg_root, "airq", CONFIG_TYPE_GROUP);
-    
-  setting = config_setting_add(airqsetting, "id", CONFIG_TYPE_STRING);
+  setting = config_setting_add(cfg_root, "history_size", CONFIG_TYPE_INT);
   if (setting == NULL) {
-    setting = config_setting_get_member(airqsetting, "id");
+    setting = config_setting_get_member(cfg_root, "history_size");
   }
-  config_setting_set_string(setting, airq.device.id);
+  config_setting_set_int(setting, g_history_size);
 
-  setting = config_setting_add(airqsetting, "name", CONFIG_TYPE_STRING);
+  if (g_history_file != NULL) {
+    setting = config_setting_add(cfg_root, "history_file", CONFIG_TYPE_STRING);
+    if (setting == NULL) {
+      setting = config_setting_get_member(cfg_root, "history_file");
+    }
+    config_setting_set_string(setting, g_history_file);
+  }
+
+  if (g_query_socket != NULL) {
+    setting = config_setting_add(cfg_root, "query_socket", CONFIG_TYPE_STRING);
+    if (setting == NULL) {
+      setting = config_setting_get_member(cfg_root, "query_socket");
+    }
+    config_setting_set_string(setting, g_query_socket);
+  }
+
+  if (g_metrics_file != NULL) {
+    setting = config_setting_add(cfg_root, "metrics_file", CONFIG_TYPE_STRING);
+    if (setting == NULL) {
+      setting = config_setting_get_member(cfg_root, "metrics_file");
+    }
+    config_setting_set_string(setting, g_metrics_file);
+  }
+
+  setting = config_setting_add(cfg_root, "zone_id", CONFIG_TYPE_INT);
   if (setting == NULL) {
-    setting = config_setting_get_member(airqsetting, "name");
+    setting = config_setting_get_member(cfg_root, "zone_id");
   }
-  config_setting_set_string(setting, airq.device.name);
-  
-  setting = config_setting_add(airqsetting, "ip", CONFIG_TYPE_STRING);
+  config_setting_set_int(setting, g_default_zoneID);
+
+  setting = config_setting_add(cfg_root, "json_validation", CONFIG_TYPE_BOOL);
   if (setting == NULL) {
-    setting = config_setting_get_member(airqsetting, "ip");
+    setting = config_setting_get_member(cfg_root, "json_validation");
   }
-  config_setting_set_string(setting, airq.device.ip);
-  
-  setting = config_setting_add(airqsetting, "password", CONFIG_TYPE_STRING);
+  config_setting_set_bool(setting, g_json_validation);
+
+  setting = config_setting_add(cfg_root, "debug", CONFIG_TYPE_INT);
   if (setting == NULL) {
-    setting = config_setting_get_member(airqsetting, "password");
+    setting = config_setting_get_member(cfg_root, "debug");
   }
-  config_setting_set_string(setting, airq.device.password); 
-   
-  
-  char path[128];
-  sprintf(path, "sensor_values");   
-  config_setting_t *sensor_values_path = config_setting_add(cfg_root, path, CONFIG_TYPE_GROUP);
+  config_setting_set_int(setting, vdc_get_debugLevel());
 
-  if (sensor_values_path == NULL) {
-    sensor_values_path = config_setting_get_member(setting, path);
+  if (airq.count == 1) {
+    airqsetting = config_setting_add(cfg_root, "airq", CONFIG_TYPE_GROUP);
+    write_device(airqsetting, airq.devices);
+    write_sensor_values(cfg_root, airq.devices);
+  } else {
+    airq_device_t* device;
+    config_setting_t* list = config_setting_add(cfg_root, "airq", CONFIG_TYPE_LIST);
+    LL_FOREACH(airq.devices, device) {
+      airqsetting = config_setting_add(list, NULL, CONFIG_TYPE_GROUP);
+      write_device(airqsetting, device);
+      write_sensor_values(airqsetting, device);
+    }
   }
-  
-  i = 0;
-  while(1) {
-    if (i < MAX_SENSOR_VALUES && airq.device.sensor_values[i].value_name != NULL) {
-      sensor_value_t* value = &airq.device.sensor_values[i];
-      
-      sprintf(path, "s%d", i);   
-      config_setting_t *v = config_setting_add(sensor_values_path, path, CONFIG_TYPE_GROUP);
-      
-      setting = config_setting_add(v, "value_name", CONFIG_TYPE_STRING);
-      if (setting == NULL) {
-        setting = config_setting_get_member(v, "value_name");
-      }
-      config_setting_set_string(setting, value->value_name);
-      
-      setting = config_setting_add(v, "sensor_type", CONFIG_TYPE_INT);
-      if (setting == NULL) {
-        setting = config_setting_get_member(v, "sensor_type");
-      }
-      config_setting_set_int(setting, value->sensor_type);
-      
-      setting = config_setting_add(v, "sensor_usage", CONFIG_TYPE_INT);
-      if (setting == NULL) {
-        setting = config_setting_get_member(v, "sensor_usage");
-      }
-      config_setting_set_int(setting, value->sensor_usage);
-      
-      i++;
-    } else {
-      break;
-    }   
-  } 
 
   char tmpfile[PATH_MAX];
   sprintf(tmpfile, "%s.cfg.new", g_cfgfile);
@@ -263,10 +537,21 @@ int write_config() {
   return 0;
 }
 
-sensor_value_t* find_sensor_value_by_name(char *key) {
+sensor_value_t* find_sensor_value_by_name(airq_device_t* device, const char *key) {
   sensor_value_t* value;
+
+  int id = airq_key_id(key);
+  if (id >= 0) {
+    int slot = device->sensor_slot[id];
+    return slot >= 0 ? &device->sensor_values[slot] : NULL;
+  }
+  if (!device->unindexed_sensors) {
+    return NULL;
+  }
+
+  /* value names unknown at build time are still looked up by name */
   for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
-    value = &airq.device.sensor_values[i];
+    value = &device->sensor_values[i];
     if (value->value_name != NULL && strcasecmp(key, value->value_name) == 0) {
         return value;
     }
@@ -0,0 +1,292 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <openssl/evp.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * The AirQ answers /data with {"content":"<base64>"}, where the decoded
+ * content is a 16 byte IV followed by the AES-256-CBC encrypted sensor
+ * JSON. The stream below decodes and decrypts the content while curl
+ * delivers the response and hands the plaintext to the sensor value
+ * extractor, so the payload is never held in memory as a whole. Only in
+ * json validation mode the plaintext is collected for json-c.
+ */
+
+static const char content_key[] = "\"content\"";
+
+static const signed char base64_table[256] = {
+  ['A'] =  0, ['B'] =  1, ['C'] =  2, ['D'] =  3, ['E'] =  4, ['F'] =  5, ['G'] =  6, ['H'] =  7,
+  ['I'] =  8, ['J'] =  9, ['K'] = 10, ['L'] = 11, ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15,
+  ['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+  ['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29, ['e'] = 30, ['f'] = 31,
+  ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35, ['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39,
+  ['o'] = 40, ['p'] = 41, ['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+  ['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53, ['2'] = 54, ['3'] = 55,
+  ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59, ['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
+};
+
+static bool is_base64(unsigned char c) {
+  return c == 'A' || base64_table[c] != 0;
+}
+
+static int stream_emit(airq_device_t* device, const unsigned char *data, size_t len) {
+  airq_stream_t* stream = &device->stream;
+
+  if (!g_json_validation) {
+    double start = vdc_monotonic_ms();
+    airq_extract_feed(device, (const char *) data, len);
+    device->extract.parse_ms += vdc_monotonic_ms() - start;
+    return AIRQ_OK;
+  }
+
+  if (stream->plain_len + len + 1 > stream->plain_size) {
+    size_t size = stream->plain_size;
+    while (size < stream->plain_len + len + 1) {
+      size *= 2;
+    }
+    char *plain = realloc(stream->plain, size);
+    if (plain == NULL) {
+      vdc_report(LOG_ERR, "crypto: not enough memory for %zu bytes payload\n", size);
+      return AIRQ_OUT_OF_MEMORY;
+    }
+    stream->plain = plain;
+    stream->plain_size = size;
+  }
+
+  memcpy(stream->plain + stream->plain_len, data, len);
+  stream->plain_len += len;
+  stream->plain[stream->plain_len] = '\0';
+  return AIRQ_OK;
+}
+
+static int stream_decrypt_window(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+  unsigned char out[AIRQ_STREAM_WINDOW + EVP_MAX_BLOCK_LENGTH];
+  int out_len = 0;
+
+  if (stream->cipher_len == 0) {
+    return AIRQ_OK;
+  }
+  if (!EVP_DecryptUpdate(stream->ctx, out, &out_len, stream->cipher, stream->cipher_len)) {
+    vdc_report(LOG_ERR, "crypto: decryption of response from %s failed\n", device->id);
+    return AIRQ_AUTH_FAILED;
+  }
+  stream->cipher_len = 0;
+
+  return stream_emit(device, out, out_len);
+}
+
+static int stream_start_cipher(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+
+  /* the key schedule is kept from airq_stream_init(), only the IV changes per response */
+  if (!EVP_DecryptInit_ex(stream->ctx, NULL, NULL, NULL, stream->iv)) {
+    vdc_report(LOG_ERR, "crypto: cannot initialize decryption for %s\n", device->id);
+    return AIRQ_AUTH_FAILED;
+  }
+  return AIRQ_OK;
+}
+
+static int stream_decoded(airq_device_t* device, const unsigned char *data, size_t len) {
+  airq_stream_t* stream = &device->stream;
+  int rc;
+
+  while (len > 0) {
+    if (stream->iv_len < (int) sizeof(stream->iv)) {
+      stream->iv[stream->iv_len++] = *data++;
+      len--;
+      if (stream->iv_len == sizeof(stream->iv) && (rc = stream_start_cipher(device)) != AIRQ_OK) {
+        return rc;
+      }
+      continue;
+    }
+
+    size_t n = sizeof(stream->cipher) - stream->cipher_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(stream->cipher + stream->cipher_len, data, n);
+    stream->cipher_len += n;
+    data += n;
+    len -= n;
+
+    if (stream->cipher_len == sizeof(stream->cipher) && (rc = stream_decrypt_window(device)) != AIRQ_OK) {
+      return rc;
+    }
+  }
+  return AIRQ_OK;
+}
+
+/* decode the remaining sextets of an incomplete (padded) base64 group */
+static int stream_flush_quad(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+  unsigned char out[3];
+  int n = stream->quad_len - 1;
+
+  if (stream->quad_len < 2) {
+    return AIRQ_OK;
+  }
+  uint32_t quad = stream->quad << (6 * (4 - stream->quad_len));
+  out[0] = quad >> 16;
+  out[1] = quad >> 8;
+  stream->quad_len = 0;
+
+  return stream_decoded(device, out, n);
+}
+
+/*
+ * Prepare the decryption context of a device once: the AirQ key is the
+ * device password, padded with '0' to 32 characters.
+ */
+int airq_stream_init(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+
+  size_t len = strlen(device->password);
+  if (len > sizeof(device->key)) {
+    len = sizeof(device->key);
+  }
+  memset(device->key, '0', sizeof(device->key));
+  memcpy(device->key, device->password, len);
+
+  stream->ctx = EVP_CIPHER_CTX_new();
+  if (stream->ctx == NULL) {
+    return AIRQ_OUT_OF_MEMORY;
+  }
+  if (!EVP_DecryptInit_ex(stream->ctx, EVP_aes_256_cbc(), NULL, device->key, NULL)) {
+    vdc_report(LOG_ERR, "crypto: cannot set up decryption for %s\n", device->id);
+    return AIRQ_BAD_CONFIG;
+  }
+
+  /* scratch area for the payload in json validation mode, grows to the largest response once and is reused */
+  stream->plain_size = 4 * AIRQ_STREAM_WINDOW;
+  stream->plain = malloc(stream->plain_size);
+  if (stream->plain == NULL) {
+    return AIRQ_OUT_OF_MEMORY;
+  }
+  stream->plain[0] = '\0';
+
+  return AIRQ_OK;
+}
+
+void airq_stream_begin(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+
+  stream->state = AIRQ_STREAM_SCAN;
+  stream->match = 0;
+  stream->quad = 0;
+  stream->quad_len = 0;
+  stream->iv_len = 0;
+  stream->cipher_len = 0;
+  stream->plain_len = 0;
+  stream->plain[0] = '\0';
+  stream->decode_ms = 0;
+
+  airq_extract_begin(device);
+}
+
+size_t airq_stream_feed(airq_device_t* device, const char *data, size_t len) {
+  airq_stream_t* stream = &device->stream;
+  unsigned char out[3];
+
+  for (size_t i = 0; i < len && stream->state != AIRQ_STREAM_ERROR; i++) {
+    unsigned char c = data[i];
+
+    switch (stream->state) {
+      case AIRQ_STREAM_SCAN:
+        if (c == content_key[stream->match]) {
+          if (++stream->match == sizeof(content_key) - 1) {
+            stream->state = AIRQ_STREAM_COLON;
+          }
+        } else {
+          stream->match = (c == '"') ? 1 : 0;
+        }
+        break;
+
+      case AIRQ_STREAM_COLON:
+        if (c == '"') {
+          stream->state = AIRQ_STREAM_CONTENT;
+        } else if (c != ':' && !isspace(c)) {
+          stream->state = AIRQ_STREAM_SCAN;
+          stream->match = 0;
+        }
+        break;
+
+      case AIRQ_STREAM_CONTENT:
+        if (c == '"') {
+          if (stream_flush_quad(device) != AIRQ_OK) {
+            stream->state = AIRQ_STREAM_ERROR;
+            break;
+          }
+          stream->state = AIRQ_STREAM_DONE;
+        } else if (is_base64(c)) {
+          /* anything else, padding and JSON escapes like \/ included, carries no data */
+          stream->quad = (stream->quad << 6) | base64_table[c];
+          if (++stream->quad_len == 4) {
+            out[0] = stream->quad >> 16;
+            out[1] = stream->quad >> 8;
+            out[2] = stream->quad;
+            stream->quad = 0;
+            stream->quad_len = 0;
+            if (stream_decoded(device, out, 3) != AIRQ_OK) {
+              stream->state = AIRQ_STREAM_ERROR;
+            }
+          }
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  /* a short count makes curl abort the transfer */
+  return stream->state == AIRQ_STREAM_ERROR ? 0 : len;
+}
+
+int airq_stream_end(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+  unsigned char out[EVP_MAX_BLOCK_LENGTH];
+  int out_len = 0;
+  int rc;
+
+  if (stream->state != AIRQ_STREAM_DONE || stream->iv_len < (int) sizeof(stream->iv)) {
+    vdc_report(LOG_ERR, "crypto: no encrypted content in response from %s\n", device->id);
+    return AIRQ_GETMEASURE_FAILED;
+  }
+  if ((rc = stream_decrypt_window(device)) != AIRQ_OK) {
+    return rc;
+  }
+  if (!EVP_DecryptFinal_ex(stream->ctx, out, &out_len)) {
+    vdc_report(LOG_ERR, "crypto: bad padding in response from %s - wrong password?\n", device->id);
+    return AIRQ_AUTH_FAILED;
+  }
+  return stream_emit(device, out, out_len);
+}
+
+void airq_stream_free(airq_device_t* device) {
+  airq_stream_t* stream = &device->stream;
+
+  if (stream->ctx != NULL) {
+    EVP_CIPHER_CTX_free(stream->ctx);
+    stream->ctx = NULL;
+  }
+  free(stream->plain);
+  stream->plain = NULL;
+  stream->plain_size = 0;
+  stream->plain_len = 0;
+}
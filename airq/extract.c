@@ -0,0 +1,268 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * Single pass extractor for the decrypted AirQ payload. The payload is a
+ * flat object of "key": [value, error] pairs; for configured keys the first
+ * array element is staged, everything else is skipped without building a
+ * document tree. The staged values only reach the sensors once the whole
+ * response was received, decrypted and parsed.
+ */
+
+enum {
+  X_START,                    /* before the opening brace */
+  X_KEY_WAIT,                 /* before a key or the closing brace */
+  X_KEY,
+  X_KEY_ESCAPE,
+  X_COLON,
+  X_VALUE,                    /* before the value of a key */
+  X_ARRAY_FIRST,              /* before the first element of a configured array */
+  X_NUMBER,
+  X_SKIP,                     /* inside a value of no interest */
+  X_SKIP_STRING,
+  X_SKIP_ESCAPE,
+  X_END,
+  X_ERROR
+};
+
+/*
+ * store a new sample, a significant change marks its slot dirty for the next push.
+ * The sample is quantized first and compared against the value of the last
+ * significant change, so slow drifts below the deadband still add up.
+ */
+bool sensor_value_update(airq_device_t* device, sensor_value_t* svalue, double value, time_t now) {
+  bool changed;
+
+  if (svalue->quantize > 0) {
+    value = round(value / svalue->quantize) * svalue->quantize;
+  }
+
+  if (svalue->last_query == 0 || svalue->restored) {
+    /* the DSS has not seen a value of this session yet */
+    changed = true;
+    svalue->restored = false;
+  } else {
+    double delta = fabs(value - svalue->reference);
+    double threshold = svalue->deadband_abs;
+
+    if (svalue->deadband_rel * fabs(svalue->reference) > threshold) {
+      threshold = svalue->deadband_rel * fabs(svalue->reference);
+    }
+    changed = (threshold > 0) ? (delta >= threshold) : (delta != 0);
+  }
+
+  if (changed) {
+    svalue->reference = value;
+  }
+  svalue->last_value = svalue->value;
+  svalue->value = value;
+  svalue->last_query = now;
+
+  if (changed) {
+    device->dirty |= 1u << (svalue - device->sensor_values);
+  }
+  return changed;
+}
+
+void airq_extract_begin(airq_device_t* device) {
+  airq_extract_t* x = &device->extract;
+
+  x->state = X_START;
+  x->key_len = 0;
+  x->num_len = 0;
+  x->depth = 0;
+  x->svalue = NULL;
+  x->staged_slots = 0;
+  x->now = time(NULL);
+  x->parse_ms = 0;
+}
+
+static void extract_number(airq_device_t* device) {
+  airq_extract_t* x = &device->extract;
+  char *end;
+
+  x->num[x->num_len] = '\0';
+  double value = strtod(x->num, &end);
+  if (end == x->num) {
+    vdc_report(LOG_WARNING, "extract: invalid number \"%s\" for %s\n", x->num, x->key);
+    return;
+  }
+
+  vdc_report(LOG_DEBUG, "extract: %s returned key: %s value: %f\n", device->id, x->key, value);
+  int slot = x->svalue - device->sensor_values;
+  x->staged[slot] = value;
+  x->staged_slots |= 1u << slot;
+}
+
+static void extract_key_char(airq_extract_t* x, char c) {
+  if (x->key_len < (int) sizeof(x->key) - 1) {
+    x->key[x->key_len++] = c;
+  } else {
+    x->key_len = sizeof(x->key);
+  }
+}
+
+void airq_extract_feed(airq_device_t* device, const char *data, size_t len) {
+  airq_extract_t* x = &device->extract;
+
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+
+    switch (x->state) {
+      case X_START:
+        if (c == '{') {
+          x->state = X_KEY_WAIT;
+        } else if (!isspace((unsigned char) c)) {
+          x->state = X_ERROR;
+        }
+        break;
+
+      case X_KEY_WAIT:
+        if (c == '"') {
+          x->key_len = 0;
+          x->state = X_KEY;
+        } else if (c == '}') {
+          x->state = X_END;
+        } else if (c != ',' && !isspace((unsigned char) c)) {
+          x->state = X_ERROR;
+        }
+        break;
+
+      case X_KEY:
+        if (c == '"') {
+          /* overlong keys cannot be configured */
+          x->key[x->key_len < (int) sizeof(x->key) ? x->key_len : 0] = '\0';
+          x->svalue = x->key_len < (int) sizeof(x->key) ? find_sensor_value_by_name(device, x->key) : NULL;
+          if (x->svalue == NULL) {
+            vdc_report(LOG_DEBUG, "extract: value %s is not configured for evaluation - ignoring\n", x->key);
+          }
+          x->state = X_COLON;
+        } else if (c == '\\') {
+          x->state = X_KEY_ESCAPE;
+        } else {
+          extract_key_char(x, c);
+        }
+        break;
+
+      case X_KEY_ESCAPE:
+        extract_key_char(x, c);
+        x->state = X_KEY;
+        break;
+
+      case X_COLON:
+        if (c == ':') {
+          x->state = X_VALUE;
+        } else if (!isspace((unsigned char) c)) {
+          x->state = X_ERROR;
+        }
+        break;
+
+      case X_VALUE:
+        if (isspace((unsigned char) c)) {
+          break;
+        }
+        if (c == '[' && x->svalue != NULL) {
+          x->state = X_ARRAY_FIRST;
+          break;
+        }
+        x->depth = 0;
+        x->state = X_SKIP;
+        i--;                  /* let the skipper see the first character */
+        break;
+
+      case X_ARRAY_FIRST:
+        if (isspace((unsigned char) c)) {
+          break;
+        }
+        x->depth = 1;
+        if (c == '-' || isdigit((unsigned char) c)) {
+          x->num_len = 0;
+          x->state = X_NUMBER;
+        } else {
+          x->state = X_SKIP;
+        }
+        i--;
+        break;
+
+      case X_NUMBER:
+        if (isdigit((unsigned char) c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+          if (x->num_len < (int) sizeof(x->num) - 1) {
+            x->num[x->num_len++] = c;
+          }
+          break;
+        }
+        extract_number(device);
+        x->state = X_SKIP;
+        i--;
+        break;
+
+      case X_SKIP:
+        if (c == '"') {
+          x->state = X_SKIP_STRING;
+        } else if (c == '[' || c == '{') {
+          x->depth++;
+        } else if (c == ']' || c == '}') {
+          if (x->depth == 0) {
+            x->state = X_END;            /* end of the payload object */
+          } else if (--x->depth == 0) {
+            x->state = X_KEY_WAIT;
+          }
+        } else if (c == ',' && x->depth == 0) {
+          x->state = X_KEY_WAIT;
+        }
+        break;
+
+      case X_SKIP_STRING:
+        if (c == '\\') {
+          x->state = X_SKIP_ESCAPE;
+        } else if (c == '"') {
+          x->state = X_SKIP;
+        }
+        break;
+
+      case X_SKIP_ESCAPE:
+        x->state = X_SKIP_STRING;
+        break;
+
+      default:
+        return;
+    }
+  }
+}
+
+/*
+ * apply the staged values, called only after the transfer and the decryption succeeded.
+ * Returns 0 if configured values have changed, 1 if not, like parse_json_data()
+ */
+int airq_extract_end(airq_device_t* device) {
+  airq_extract_t* x = &device->extract;
+  bool changed = false;
+
+  if (x->state != X_END) {
+    vdc_report(LOG_ERR, "extract: incomplete or invalid payload from %s\n", device->id);
+    return AIRQ_GETMEASURE_FAILED;
+  }
+
+  for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
+    if ((x->staged_slots & (1u << i)) && sensor_value_update(device, &device->sensor_values[i], x->staged[i], x->now)) {
+      changed = true;
+    }
+  }
+  return changed ? 0 : 1;
+}
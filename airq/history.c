@@ -0,0 +1,343 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * Per sensor history of the received values, compressed like Facebook's
+ * Gorilla time series store: timestamps as delta of deltas, values as XOR
+ * against the previous value with the leading and trailing zero bits cut off.
+ * Regular polls of slowly changing values take a few bits per sample.
+ *
+ * Samples are appended to fixed size blocks, the blocks of a sensor form a
+ * ring and the oldest block is reused when all are full. All blocks of a
+ * device are allocated at startup, appending never allocates. The decoder
+ * iterates sample by sample and never expands a block.
+ */
+
+#define BLOCK_BITS (AIRQ_BLOCK_WORDS * 64)
+#define SAMPLE_MAX_BITS (4 + 32 + 2 + 5 + 6 + 64)
+/* samples a block holds at least: the raw first one and the worst case for all others */
+#define BLOCK_MIN_SAMPLES (1 + (BLOCK_BITS - 64) / SAMPLE_MAX_BITS)
+
+static void put_bits(airq_history_block_t* b, uint64_t value, int n) {
+  while (n > 0) {
+    int off = b->bits % 64;
+    int take = n < 64 - off ? n : 64 - off;
+    uint64_t chunk = (value >> (n - take)) & (take == 64 ? ~0ULL : (1ULL << take) - 1);
+
+    b->data[b->bits / 64] |= chunk << (64 - off - take);
+    b->bits += take;
+    n -= take;
+  }
+}
+
+static uint64_t get_bits(const airq_history_block_t* b, uint32_t* pos, int n) {
+  uint64_t value = 0;
+
+  while (n > 0) {
+    int off = *pos % 64;
+    int take = n < 64 - off ? n : 64 - off;
+    uint64_t chunk = (b->data[*pos / 64] >> (64 - off - take)) & (take == 64 ? ~0ULL : (1ULL << take) - 1);
+
+    value = (take == 64) ? chunk : (value << take) | chunk;
+    *pos += take;
+    n -= take;
+  }
+  return value;
+}
+
+static uint64_t double_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static double bits_double(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/* the ranges are those of two's complement numbers of 7, 9 and 12 bits, see sign_extend() */
+static void put_timestamp(airq_history_block_t* b, int64_t dod) {
+  if (dod == 0) {
+    put_bits(b, 0, 1);
+  } else if (dod >= -64 && dod <= 63) {
+    put_bits(b, 0x2, 2);
+    put_bits(b, (uint64_t) dod, 7);
+  } else if (dod >= -256 && dod <= 255) {
+    put_bits(b, 0x6, 3);
+    put_bits(b, (uint64_t) dod, 9);
+  } else if (dod >= -2048 && dod <= 2047) {
+    put_bits(b, 0xe, 4);
+    put_bits(b, (uint64_t) dod, 12);
+  } else {
+    put_bits(b, 0xf, 4);
+    put_bits(b, (uint64_t) dod, 32);
+  }
+}
+
+static int64_t sign_extend(uint64_t value, int bits) {
+  uint64_t sign = 1ULL << (bits - 1);
+  value &= (1ULL << bits) - 1;
+  return (int64_t) ((value ^ sign) - sign);
+}
+
+static int64_t get_timestamp(const airq_history_block_t* b, uint32_t* pos) {
+  if (get_bits(b, pos, 1) == 0) {
+    return 0;
+  }
+  if (get_bits(b, pos, 1) == 0) {
+    return sign_extend(get_bits(b, pos, 7), 7);
+  }
+  if (get_bits(b, pos, 1) == 0) {
+    return sign_extend(get_bits(b, pos, 9), 9);
+  }
+  if (get_bits(b, pos, 1) == 0) {
+    return sign_extend(get_bits(b, pos, 12), 12);
+  }
+  return sign_extend(get_bits(b, pos, 32), 32);
+}
+
+/* '0' same value, '10' XOR fits the previous window, '11' new window: 5 bits leading zeros, 6 bits length */
+static void put_value(airq_history_t* h, airq_history_block_t* b, uint64_t bits) {
+  uint64_t x = bits ^ h->last_bits;
+
+  if (x == 0) {
+    put_bits(b, 0, 1);
+    return;
+  }
+
+  int lead = __builtin_clzll(x);
+  int trail = __builtin_ctzll(x);
+  if (lead > 31) {
+    lead = 31;
+  }
+
+  if (h->lead >= 0 && lead >= h->lead && trail >= h->trail) {
+    put_bits(b, 0x2, 2);
+    put_bits(b, x >> h->trail, 64 - h->lead - h->trail);
+  } else {
+    int len = 64 - lead - trail;
+    put_bits(b, 0x3, 2);
+    put_bits(b, lead, 5);
+    put_bits(b, len & 0x3f, 6);       /* 64 is stored as 0 */
+    put_bits(b, x >> trail, len);
+    h->lead = lead;
+    h->trail = trail;
+  }
+}
+
+static uint64_t get_value(airq_history_iter_t* it, const airq_history_block_t* b) {
+  if (get_bits(b, &it->pos, 1) == 0) {
+    return it->bits;
+  }
+  if (get_bits(b, &it->pos, 1) == 1) {
+    it->lead = get_bits(b, &it->pos, 5);
+    int len = get_bits(b, &it->pos, 6);
+    it->trail = 64 - it->lead - (len ? len : 64);
+    if (it->trail < 0) {
+      it->trail = 0;            /* only a reader racing the writer sees this, its result is dropped */
+    }
+  }
+  return it->bits ^ (get_bits(b, &it->pos, 64 - it->lead - it->trail) << it->trail);
+}
+
+int airq_history_init(airq_device_t* device, uint32_t capacity) {
+  int sensors = 0;
+
+  while (sensors < MAX_SENSOR_VALUES && device->sensor_values[sensors].is_active) {
+    sensors++;
+  }
+  if (sensors == 0 || capacity == 0) {
+    return AIRQ_OK;
+  }
+
+  /*
+   * capacity samples fit even if none of them compresses, compressible values are
+   * kept longer in the same memory. One extra block, the oldest one is dropped
+   * as a whole when the head block needs room.
+   */
+  uint32_t nblocks = ((uint64_t) capacity + BLOCK_MIN_SAMPLES - 1) / BLOCK_MIN_SAMPLES + 1;
+
+  device->history_blocks = calloc((size_t) sensors * nblocks, sizeof(airq_history_block_t));
+  if (device->history_blocks == NULL) {
+    return AIRQ_OUT_OF_MEMORY;
+  }
+
+  for (int i = 0; i < sensors; i++) {
+    airq_history_t* h = &device->sensor_values[i].history;
+
+    memset(h, 0, sizeof(airq_history_t));
+    h->blocks = device->history_blocks + (size_t) i * nblocks;
+    h->nblocks = nblocks;
+  }
+
+  vdc_report(LOG_INFO, "history of %s: %u blocks for %d sensors, %zu bytes\n", device->id, nblocks, sensors,
+      (size_t) sensors * nblocks * sizeof(airq_history_block_t));
+  return AIRQ_OK;
+}
+
+void airq_history_free(airq_device_t* device) {
+  for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
+    memset(&device->sensor_values[i].history, 0, sizeof(airq_history_t));
+  }
+  free(device->history_blocks);
+  device->history_blocks = NULL;
+}
+
+/* move on to the next block, dropping the oldest one if the ring is full */
+static airq_history_block_t* history_next_block(airq_history_t* h) {
+  if (h->used > 0) {
+    airq_history_block_t* full = &h->blocks[h->head];
+    vdc_report(LOG_DEBUG, "history: block of %u samples closed, %.1f bytes per sample\n",
+        full->count, full->bits / 8.0 / full->count);
+    h->head = (h->head + 1) % h->nblocks;
+  }
+  if (h->used == h->nblocks) {
+    h->count -= h->blocks[h->head].count;
+  } else {
+    h->used++;
+  }
+
+  airq_history_block_t* b = &h->blocks[h->head];
+  memset(b, 0, sizeof(airq_history_block_t));
+  return b;
+}
+
+void airq_history_add(airq_history_t* h, time_t time, double value) {
+  airq_history_block_t* b;
+  uint64_t bits = double_bits(value);
+
+  if (h->nblocks == 0) {
+    return;
+  }
+
+  b = &h->blocks[h->head];
+  if (h->used == 0 || b->bits + SAMPLE_MAX_BITS > BLOCK_BITS) {
+    b = history_next_block(h);
+  }
+
+  if (b->count == 0) {
+    /* a block starts with the raw sample, so every block decodes on its own */
+    b->first_time = time;
+    put_bits(b, bits, 64);
+    h->last_delta = 0;
+    h->lead = -1;
+    h->trail = 0;
+  } else {
+    int64_t delta = time - h->last_time;
+    put_timestamp(b, delta - h->last_delta);
+    put_value(h, b, bits);
+    h->last_delta = delta;
+  }
+
+  h->last_time = time;
+  h->last_bits = bits;
+  b->count++;
+  h->count++;
+}
+
+/*
+ * record every sensor the last poll delivered a value for, called by the network thread.
+ * Readers in other threads decode the blocks under history_seq and retry when it moved.
+ */
+void airq_history_append(airq_device_t* device) {
+  unsigned seq = atomic_load_explicit(&device->shared.history_seq, memory_order_relaxed);
+
+  atomic_store_explicit(&device->shared.history_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    sensor_value_t* svalue = &device->sensor_values[i];
+
+    /* not polled since the last append, the history may be too small to tell */
+    if (svalue->last_query <= svalue->last_appended) {
+      continue;
+    }
+    airq_history_add(&svalue->history, svalue->last_query, svalue->value);
+    airq_aggregate_add(svalue, svalue->last_query, svalue->value);
+    airq_store_append(device, svalue, svalue->last_query, svalue->value);
+    svalue->last_appended = svalue->last_query;
+  }
+
+  atomic_store_explicit(&device->shared.history_seq, seq + 2, memory_order_release);
+  airq_store_sync();
+}
+
+void airq_history_iter_init(airq_history_iter_t* it, const airq_history_t* h) {
+  memset(it, 0, sizeof(airq_history_iter_t));
+  it->h = h;
+  it->blocks_left = h->used;
+  if (h->used > 0) {
+    it->block = (h->head + h->nblocks - h->used + 1) % h->nblocks;
+  }
+}
+
+/* next sample from the oldest to the newest, false at the end */
+bool airq_history_next(airq_history_iter_t* it, time_t* time, double* value) {
+  const airq_history_t* h = it->h;
+  const airq_history_block_t* b = NULL;
+
+  while (it->blocks_left > 0) {
+    b = &h->blocks[it->block];
+    if (it->n < b->count) {
+      break;
+    }
+    it->block = (it->block + 1) % h->nblocks;
+    it->blocks_left--;
+    it->n = 0;
+    it->pos = 0;
+  }
+  if (it->blocks_left == 0) {
+    return false;
+  }
+  /* every sample starts within this bound, a reader racing the writer must not run off the block */
+  if (it->pos > BLOCK_BITS - SAMPLE_MAX_BITS) {
+    return false;
+  }
+
+  if (it->n == 0) {
+    it->time = b->first_time;
+    it->delta = 0;
+    it->bits = get_bits(b, &it->pos, 64);
+    it->lead = 0;
+    it->trail = 0;
+  } else {
+    it->delta += get_timestamp(b, &it->pos);
+    it->time += it->delta;
+    it->bits = get_value(it, b);
+  }
+  it->n++;
+
+  *time = it->time;
+  *value = bits_double(it->bits);
+  return true;
+}
+
+/* compression ratio achieved so far, 16 bytes per sample would be the raw size */
+double airq_history_bytes_per_sample(const airq_history_t* h) {
+  uint64_t bits = 0;
+
+  if (h->count == 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < h->used; i++) {
+    bits += h->blocks[(h->head + h->nblocks - i) % h->nblocks].bits;
+  }
+  return bits / 8.0 / h->count;
+}
@@ -0,0 +1,162 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * Benchmark of the compressed history: bytes per sample and encode / decode
+ * throughput for typical sensor series. Every series is decoded again and
+ * compared sample by sample, timestamp jumps on the boundaries of the delta
+ * of delta encodings included. Exits with 1 on any mismatch.
+ *
+ *   history-bench [samples]
+ */
+
+#define BENCH_SAMPLES 1000000
+
+/* history.c appends to the aggregates and the store, neither is needed here */
+void airq_aggregate_add(sensor_value_t* svalue, time_t time, double value) { }
+void airq_store_append(airq_device_t* device, sensor_value_t* svalue, time_t time, double value) { }
+void airq_store_sync() { }
+
+typedef struct series {
+  const char* name;
+  time_t* time;
+  double* value;
+  size_t count;
+} series_t;
+
+/*
+ * delays of single polls that hit the limits of every timestamp encoding,
+ * the delayed poll and the return to the regular interval give dods of +d and -d
+ */
+static const int64_t jitter[] = {
+  1, 63, 64, 65, 255, 256, 257, 2047, 2048, 2049, 100000
+};
+
+static time_t next_time(time_t t, size_t i, bool jittered) {
+  if (!jittered || i % 2 != 0) {
+    return t + 60;
+  }
+  return t + 60 + jitter[(i / 2) % (sizeof(jitter) / sizeof(jitter[0]))];
+}
+
+static void series_fill(series_t* s, const char* name, size_t count, int kind) {
+  time_t t = 1700000000;
+  double v = kind == 1 ? 600 : 21.5;
+
+  s->name = name;
+  s->count = count;
+  s->time = malloc(count * sizeof(time_t));
+  s->value = malloc(count * sizeof(double));
+  if (s->time == NULL || s->value == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    switch (kind) {
+      case 0:         /* temperature: slow random walk, 0.1 resolution */
+        if (random() % 4 == 0) {
+          v += (random() % 3 - 1) * 0.1;
+        }
+        s->value[i] = round(v * 10) / 10;
+        break;
+      case 1:         /* co2: integer ppm */
+        v += random() % 11 - 5;
+        s->value[i] = round(v);
+        break;
+      default:        /* noise, the worst case */
+        s->value[i] = (double) random() / RAND_MAX * 1000;
+        break;
+    }
+    s->time[i] = t;
+    t = next_time(t, i, kind == 3);
+  }
+}
+
+static int series_run(const series_t* s) {
+  const size_t block_bytes = sizeof(airq_history_block_t);
+  airq_history_t h;
+  airq_history_iter_t it;
+  time_t time;
+  double value;
+  size_t n = 0;
+  int errors = 0;
+
+  /* room for every sample even without any compression */
+  memset(&h, 0, sizeof(h));
+  h.nblocks = s->count * 16 / (AIRQ_BLOCK_WORDS * 8) + 2;
+  h.blocks = calloc(h.nblocks, block_bytes);
+  if (h.blocks == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  double start = vdc_monotonic_ms();
+  for (size_t i = 0; i < s->count; i++) {
+    airq_history_add(&h, s->time[i], s->value[i]);
+  }
+  double encoded = vdc_monotonic_ms();
+
+  airq_history_iter_init(&it, &h);
+  while (airq_history_next(&it, &time, &value)) {
+    if (n >= s->count || time != s->time[n] || memcmp(&value, &s->value[n], sizeof(double)) != 0) {
+      if (errors++ < 5) {
+        fprintf(stderr, "%s: sample %zu decoded as %ld %.17g, expected %ld %.17g\n", s->name, n,
+            (long) time, value, n < s->count ? (long) s->time[n] : 0L, n < s->count ? s->value[n] : 0);
+      }
+    }
+    n++;
+  }
+  double decoded = vdc_monotonic_ms();
+
+  if (n != s->count) {
+    fprintf(stderr, "%s: %zu of %zu samples decoded\n", s->name, n, s->count);
+    errors++;
+  }
+
+  printf("%-12s %8.2f bytes/sample  encode %7.1f M/s  decode %7.1f M/s  %s\n", s->name,
+      airq_history_bytes_per_sample(&h), s->count / (encoded - start) / 1e3, s->count / (decoded - encoded) / 1e3,
+      errors ? "MISMATCH" : "ok");
+
+  free(h.blocks);
+  return errors;
+}
+
+int main(int argc, char** argv) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_SAMPLES;
+  series_t series[4];
+  int errors = 0;
+
+  if (count == 0) {
+    fprintf(stderr, "usage: %s [samples]\n", argv[0]);
+    return 2;
+  }
+  srandom(1);
+  series_fill(&series[0], "temperature", count, 0);
+  series_fill(&series[1], "co2", count, 1);
+  series_fill(&series[2], "noise", count, 2);
+  series_fill(&series[3], "jitter", count, 3);
+
+  printf("%zu samples per series, raw size 16 bytes/sample\n", count);
+  for (int i = 0; i < 4; i++) {
+    errors += series_run(&series[i]);
+    free(series[i].time);
+    free(series[i].value);
+  }
+  return errors ? 1 : 0;
+}
@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 
 #include <libconfig.h>
 #include <curl/curl.h>
@@ -32,7 +33,7 @@ const char *g_cfgfile = "airq.cfg";
 const char *version = "0.0.1";
 int g_shutdown_flag = 0;
 airq_data_t airq;
-airq_vdcd_t* airq_device = NULL;
+airq_vdcd_t* airq_devices = NULL;
 scene_t* airq_current_values = NULL;
 
 /* VDC-API data */
@@ -45,11 +46,24 @@ char g_lib_dsuid[35] = { 0, };
 /* Klafs Data */
 
 time_t g_reload_values = 1 * 60;
+time_t g_reload_values_min = 0;
+time_t g_reload_values_max = 0;
+long g_connect_timeout = 5;
+long g_request_timeout = 20;
+uint32_t g_history_size = DEFAULT_HISTORY_SIZE;
+char* g_history_file = NULL;
+char* g_query_socket = NULL;
+char* g_metrics_file = NULL;
 int g_default_zoneID = 65534;
+bool g_json_validation = false;
 
-static time_t g_query_values_time = 0;
-static bool g_network_changes = false;
-pthread_mutex_t g_network_mutex;
+/* signaled by the network thread when new values are ready to be pushed */
+static int g_notify_fd = -1;
+/* runs dsvdc_work(), SIGUSR1 interrupts its wait when new values are ready */
+static pthread_t g_main_thread;
+
+/* longest wait in dsvdc_work(), bounds the delay of a notification that came too late to interrupt it */
+#define MAIN_LOOP_WAIT_S 1
 
 dsvdc_t *handle = NULL;
 
@@ -69,102 +83,266 @@ void print_usage() {
 void signal_handler(int signum) {
   if ((signum == SIGINT) || (signum == SIGTERM)) {
     g_shutdown_flag++;
+    airq_network_wakeup();
+  } else if (signum == SIGUSR1) {
+    /* nothing to do, the signal only makes dsvdc_work() return */
+  } else if (signum == SIGHUP) {
+    airq_network_poll_all();
   }
 }
 
-void* networkThread(void *arg __attribute__((unused))) {
-  int rc;
-  static time_t last = 0;
+/*
+ * Adaptive polling, enabled by reload_values_min < reload_values_max: while
+ * values move significantly the poll interval halves down to the minimum,
+ * every poll without a significant change stretches it by half up to the maximum.
+ */
+static time_t next_poll_interval(airq_device_t* device, bool changed) {
+  if (g_reload_values_min <= 0 || g_reload_values_max <= g_reload_values_min) {
+    device->poll_interval = g_reload_values;
+    return g_reload_values;
+  }
 
-  while (!g_shutdown_flag) {
-    sleep(5);
-    time_t now = time(NULL);
-  
-    if (now >= last + 10) {
-      vdc_report(LOG_DEBUG, "Network Thread: time %ld, last time %ld, queryValuesTime %d\n", now, last, g_query_values_time);
-
-      if ( (g_query_values_time <= now)) {        
-        rc = airq_get_values();
-        if (rc == 0) {                 //getting values from KLAFS API succeeded and some values have changed compared to previous get values
-          g_query_values_time = g_reload_values + now;
-          g_network_changes = true;                  // send to upstream DSS
-          vdc_report(LOG_DEBUG, "changed values detected - sending to DSS\n");
-        } else if (rc == 1) {         //getting values from KLAFS API succeeded but no values have changed compared to previous get values
-          g_query_values_time = g_reload_values + now;
-          g_network_changes = false;                 // no send to upstream DSS  
-          vdc_report(LOG_DEBUG, "airq values did not change - not sending to DSS\n");
-        } else {                                     //getting values from KLAFS API failed - retry in one minute
-          now = time(NULL);
-          g_query_values_time = 60 + now;
-          g_network_changes = false;                 // no send to upstream DSS  
-          dsvdc_send_pong(handle, airq_device->dsuidstring);
-        }
-      }
-      last = now;
+  double interval = device->poll_interval > 0 ? device->poll_interval : g_reload_values;
+  interval = changed ? interval / 2 : interval * 1.5;
+  if (interval < g_reload_values_min) {
+    interval = g_reload_values_min;
+  } else if (interval > g_reload_values_max) {
+    interval = g_reload_values_max;
+  }
+
+  if ((time_t) (interval + 0.5) != (time_t) (device->poll_interval + 0.5)) {
+    vdc_report(LOG_INFO, "poll interval of %s is now %.0f s\n", device->id, interval);
+  }
+  device->poll_interval = interval;
+  return (time_t) (interval + 0.5);
+}
+
+/* exponential backoff with equal jitter, so devices failing together do not retry in lockstep */
+static time_t retry_delay(airq_device_t* device) {
+  time_t delay = RETRY_DELAY_MIN;
+
+  for (unsigned int i = 1; i < device->failures && delay < RETRY_DELAY_MAX; i++) {
+    delay *= 2;
+  }
+  if (delay > RETRY_DELAY_MAX) {
+    delay = RETRY_DELAY_MAX;
+  }
+  return delay / 2 + random() % (delay / 2 + 1);
+}
+
+static const char* breaker_name(int state) {
+  switch (state) {
+    case AIRQ_BREAKER_CLOSED: return "closed";
+    case AIRQ_BREAKER_OPEN: return "open";
+    case AIRQ_BREAKER_HALF_OPEN: return "half open";
+  }
+  return "unknown";
+}
+
+/*
+ * Circuit breaker: after BREAKER_THRESHOLD failed polls in a row the vdSD is
+ * reported as not present, the retries keep probing the device and the first
+ * successful poll closes the breaker and makes the vdSD present again.
+ */
+static void breaker_update(airq_device_t* device, bool success) {
+  int state = atomic_load(&device->breaker);
+  int next = state;
+
+  if (success) {
+    device->failures = 0;
+    next = AIRQ_BREAKER_CLOSED;
+  } else {
+    device->failures++;
+    if (state != AIRQ_BREAKER_CLOSED || device->failures >= BREAKER_THRESHOLD) {
+      next = AIRQ_BREAKER_OPEN;
+    }
+  }
+
+  if (next != state) {
+    atomic_store(&device->breaker, next);
+    if (device->vdcd && (state == AIRQ_BREAKER_CLOSED || next == AIRQ_BREAKER_CLOSED)) {
+      device->vdcd->present = (next == AIRQ_BREAKER_CLOSED);
+      airq_notify_main();
+    }
+    vdc_report(next == AIRQ_BREAKER_CLOSED ? LOG_NOTICE : LOG_WARNING, "circuit breaker of %s: %s -> %s after %u failures\n",
+        device->id, breaker_name(state), breaker_name(next), device->failures);
+  }
+}
+
+void airq_values_received(airq_device_t* device, int rc) {
+  breaker_update(device, rc == 0 || rc == 1);
+  airq_metrics_count(AIRQ_COUNTER_POLLS, 1);
+
+  if (rc == 0) {                 //getting values from AirQ succeeded and some values have changed compared to previous get values
+    airq_network_schedule(device, next_poll_interval(device, true));
+    vdc_report(LOG_DEBUG, "changed values detected on %s - sending to DSS\n", device->id);
+    airq_notify_main();
+  } else if (rc == 1) {          //getting values from AirQ succeeded but no values have changed compared to previous get values
+    airq_network_schedule(device, next_poll_interval(device, false));
+    vdc_report(LOG_DEBUG, "airq values of %s did not change - not sending to DSS\n", device->id);
+  } else {                       //getting values from AirQ failed - retry with backoff
+    time_t delay = retry_delay(device);
+    airq_metrics_count(AIRQ_COUNTER_POLL_FAILURES, 1);
+    vdc_report(LOG_NOTICE, "poll of %s failed (%d), retry in %ld s\n", device->id, rc, (long) delay);
+    airq_network_schedule(device, delay);
+    if (device->vdcd) {
+      dsvdc_send_pong(handle, device->vdcd->dsuidstring);
     }
   }
+}
+
+/* wake the main loop, called from the network thread */
+void airq_notify_main() {
+  uint64_t one = 1;
+  ssize_t ret = write(g_notify_fd, &one, sizeof(one));
+  (void) ret;
+  pthread_kill(g_main_thread, SIGUSR1);
+}
+
+void* networkThread(void *arg __attribute__((unused))) {
+  airq_network_run();
 
   return NULL;
 }
 
-void announce_device() {
-  vdc_report(LOG_INFO, "Announcing device %p: %s...\n", airq_device, airq_device->dsuidstring);
+void announce_device(airq_vdcd_t* vdcd) {
+  vdc_report(LOG_INFO, "Announcing device %p: %s...\n", vdcd, vdcd->dsuidstring);
   int ret = dsvdc_announce_device(handle,
                             g_vdc_dsuid,
-                            airq_device->dsuidstring,
+                            vdcd->dsuidstring,
                             (void *) NULL,
                             vdc_announce_device_cb);
   vdc_report(LOG_DEBUG, "Announce device return code: %d\n", ret);      
   if (ret == DSVDC_OK) {
-    airq_device->announced = true;
+    vdcd->announced = true;
   }
 }
 
-void push_sensor_data() {
+/* push the states of the given sensor slots */
+void push_sensor_data(airq_vdcd_t* vdcd, const airq_snapshot_t* snapshot, uint32_t slots) {
   dsvdc_property_t* pushEnvelope;
   dsvdc_property_t* propState;  
   dsvdc_property_t* prop;
+  airq_device_t* device = vdcd->device;
+  double now_ms = vdc_monotonic_ms();
 
   dsvdc_property_new (&pushEnvelope);
   dsvdc_property_new (&propState);
   
-  int i = 0;
-  while (1) {
-    if (airq_device->device->sensor_values[i].is_active) {
-      double val = airq_device->device->sensor_values[i].value;
-      time_t now = time (NULL);
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    if (!(slots & (1u << i))) {
+      continue;
+    }
+    double val = snapshot->values[i].value;
+    time_t now = time (NULL);
 
-      if (dsvdc_property_new (&prop) != DSVDC_OK) {
-        vdc_report(LOG_ERR, "create new property failed!");
-        continue;
-      }
-      dsvdc_property_add_double (prop, "value", val);
-      dsvdc_property_add_int (prop, "age", now - airq_device->device->sensor_values[i].last_query);
-      dsvdc_property_add_int (prop, "error", 0);
-
-      char sensorIndex[64];
-      snprintf (sensorIndex, 64, "%d", i);
-      dsvdc_property_add_property (propState, sensorIndex, &prop);
-
-      airq_device->device->sensor_values[i].last_reported = now;
-      
-      i++;
-    } else {
-      break;
+    if (dsvdc_property_new (&prop) != DSVDC_OK) {
+      vdc_report(LOG_ERR, "create new property failed!");
+      continue;
     }
+    dsvdc_property_add_double (prop, "value", val);
+    dsvdc_property_add_int (prop, "age", now - snapshot->values[i].last_query);
+    dsvdc_property_add_int (prop, "error", 0);
+
+    char sensorIndex[64];
+    snprintf (sensorIndex, 64, "%d", i);
+    dsvdc_property_add_property (propState, sensorIndex, &prop);
+
+    device->sensor_values[i].last_reported = now;
+    device->sensor_values[i].last_push_ms = now_ms;
+    device->sensor_values[i].last_pushed_value = val;
   }
   
   dsvdc_property_add_property (pushEnvelope, "sensorStates", &propState);
-  dsvdc_push_property (handle, airq_device->dsuidstring, pushEnvelope);
+  dsvdc_push_property (handle, vdcd->dsuidstring, pushEnvelope);
   dsvdc_property_free (pushEnvelope);  
 }
 
+/*
+ * Alive signs: a sensor whose value did not change for almost its
+ * aliveSignInterval is queued for a push again, a bit before the DSS
+ * would consider it dead. Only values the device still delivers are
+ * refreshed, a sensor of an unreachable AirQ is left to expire.
+ */
+static uint32_t alive_sign_due(airq_device_t* device, double now_ms) {
+  airq_snapshot_t snapshot;
+  time_t now = time(NULL);
+  uint32_t due = 0;
+
+  airq_snapshot_read(device, &snapshot);
+  device->next_alive_ms = 0;
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    sensor_value_t* svalue = &device->sensor_values[i];
+
+    if (svalue->alive_sign_interval <= 0 || svalue->last_push_ms == 0) {
+      continue;
+    }
+
+    double margin = svalue->alive_sign_interval / 10;
+    if (margin > 30) {
+      margin = 30;
+    }
+    double deadline = svalue->last_push_ms + (svalue->alive_sign_interval - margin) * 1000;
+
+    if (deadline <= now_ms) {
+      if (now - snapshot.values[i].last_query < svalue->alive_sign_interval) {
+        due |= 1u << i;
+      }
+      /* look again after the next poll */
+      deadline = now_ms + g_reload_values * 1000;
+    }
+    if (device->next_alive_ms == 0 || deadline < device->next_alive_ms) {
+      device->next_alive_ms = deadline;
+    }
+  }
+
+  return due;
+}
+
+/*
+ * Push governor: changed slots wait in push_pending until minPushInterval
+ * has passed since their last push, so a burst of changes goes out as one
+ * push of the latest value. A slot that went back to the value pushed last
+ * is dropped while its changesOnlyInterval is running, unless it is due for
+ * an alive sign: that one repeats the last value on purpose.
+ */
+static uint32_t push_governor_due(airq_device_t* device, const airq_snapshot_t* snapshot, double now_ms) {
+  uint32_t due = 0;
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    sensor_value_t* svalue = &device->sensor_values[i];
+    uint32_t slot = 1u << i;
+
+    if (!((device->push_pending | device->alive_pending) & slot)) {
+      continue;
+    }
+    if (svalue->last_push_ms == 0) {
+      due |= slot;
+      continue;
+    }
+
+    double since = now_ms - svalue->last_push_ms;
+    if (!(device->alive_pending & slot) && snapshot->values[i].value == svalue->last_pushed_value &&
+        since < svalue->changes_only_interval * 1000) {
+      device->push_pending &= ~slot;
+    } else if (since >= svalue->min_push_interval * 1000) {
+      due |= slot;
+    }
+  }
+
+  device->push_pending &= ~due;
+  device->alive_pending &= ~due;
+  return due;
+}
+
 int main(int argc __attribute__((unused)), char **argv __attribute__((unused))) {
   struct sigaction action;
   pthread_t networkThreadId;
 
   int o, opt_index;
   bool ready = false;
+  airq_vdcd_t* vdcd;
 
   static struct option long_options[] =
     {
@@ -210,6 +388,16 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
     return EXIT_FAILURE;
   }
 
+  if (sigaction(SIGHUP, &action, NULL) < 0) {
+    vdc_report(LOG_ERR, "Could not register SIGHUP handler!\n");
+    return EXIT_FAILURE;
+  }
+
+  if (sigaction(SIGUSR1, &action, NULL) < 0) {
+    vdc_report(LOG_ERR, "Could not register SIGUSR1 handler!\n");
+    return EXIT_FAILURE;
+  }
+
   curl_global_init(CURL_GLOBAL_ALL);
 
   memset(&airq, 0, sizeof(airq_data_t));
@@ -223,9 +411,6 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
     exit(0);
   }
 
-  char buffer[128] = { 0, };
-  strncpy(buffer, airq.device.id, 64);
-
   /* generate a dsuid v1 for the vdc */
   dsuid_t gdsuid;
   if (g_vdc_dsuid[0] == 0) {
@@ -245,6 +430,11 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
     vdc_report(LOG_ERR, "Could not write configuration data!\n");
   }
 
+  /* restore the last known values and their history before talking to anyone */
+  if (airq_store_open() != AIRQ_OK) {
+    vdc_report(LOG_WARNING, "History store not available, values are not kept across restarts\n");
+  }
+
    airq_current_values = malloc(sizeof(scene_t));
    if (!airq_current_values) {
     return AIRQ_OUT_OF_MEMORY;
@@ -279,80 +469,137 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 
   /* delegate network access on a separate thread */
   /* avoid to block the dsvdc main loop and vdsm query timeouts */
-  pthread_mutexattr_t mta;
-  pthread_mutexattr_init(&mta);
-  pthread_mutexattr_settype(&mta, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init(&g_network_mutex, &mta);
+  g_main_thread = pthread_self();
+  g_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_notify_fd < 0) {
+    vdc_report(LOG_ERR, "Notification channel initialization failed\n");
+    return EXIT_FAILURE;
+  }
+  if (airq_network_init() != AIRQ_OK) {
+    return EXIT_FAILURE;
+  }
   if (pthread_create(&networkThreadId, NULL, &networkThread, 0) != 0) {
     vdc_report(LOG_ERR, "Network thread initialization failed\n");
     return EXIT_FAILURE;
   }
+  if (airq_query_start() != AIRQ_OK) {
+    vdc_report(LOG_WARNING, "Query socket not available\n");
+  }
 
   while (!g_shutdown_flag) {
-    /* let the work function do our timing, 2secs timeout */
-    dsvdc_work(handle, 2);
-
-    /* do not block here if network thread currently pulls new values,
-     * push properties can wait and sent later if lock can be taken
+    /* dsvdc_work() waits in select() on sockets it does not expose, so the
+     * eventfd cannot join that wait. The network thread interrupts it with
+     * SIGUSR1 instead, select() is never restarted after a signal handler.
+     * Only a notification between the read below and the select() waits
+     * for the timeout, the eventfd keeps it until the next round.
      */
-    if (pthread_mutex_trylock(&g_network_mutex) != 0) {
-      continue;
-    }
+    uint64_t count;
+    bool notified = read(g_notify_fd, &count, sizeof(count)) == sizeof(count);
+    dsvdc_work(handle, notified ? 0 : MAIN_LOOP_WAIT_S);
 
     if (!dsvdc_has_session (handle)) {
-      airq_device->announced = false;
-   
-      pthread_mutex_unlock(&g_network_mutex);
-      continue;
-    }
-
-    if (!airq_device->announced) {
-      announce_device();
+      LL_FOREACH(airq_devices, vdcd) {
+        vdcd->announced = false;
+      }
       continue;
     }
 
-    if (!airq_device->present) {
-      if(airq_device->presentSignaled) {
-        dsvdc_device_vanished(handle, airq_device->dsuidstring);
-        airq_device->presentSignaled = false;
+    /* at most one announce or presence change per device and round, let dsvdc_work process the replies */
+    LL_FOREACH(airq_devices, vdcd) {
+      if (!vdcd->announced) {
+        announce_device(vdcd);
         continue;
       }
-    } else {
-      if (!airq_device->presentSignaled) {
-        dsvdc_identify_device(handle, airq_device->dsuidstring);
-        airq_device->presentSignaled = true;
-        continue;
-      } 
-    }
 
-    // new data from the network?
-    if (g_network_changes) {
-      g_network_changes = false;
+      if (!vdcd->present) {
+        if(vdcd->presentSignaled) {
+          dsvdc_device_vanished(handle, vdcd->dsuidstring);
+          vdcd->presentSignaled = false;
+          continue;
+        }
+      } else {
+        if (!vdcd->presentSignaled) {
+          dsvdc_identify_device(handle, vdcd->dsuidstring);
+          vdcd->presentSignaled = true;
+          continue;
+        } 
+      }
 
-      vdc_report(LOG_DEBUG, "Main loop: airq_device %p: - dsuid %s - presentSignaled %s, announced %s\n",
-            airq_device, airq_device->dsuidstring,
-            airq_device->presentSignaled ? "yes" : "no",
-            airq_device->announced? "yes" : "no"); 
+      // new data from the network? changes wait in push_pending until the governor lets them go
+      airq_device_t* device = vdcd->device;
+      uint32_t changed = airq_snapshot_take_dirty(device);
+      device->push_pending |= changed;
+      if (vdc_monotonic_ms() >= device->next_alive_ms) {
+        device->alive_pending |= alive_sign_due(device, vdc_monotonic_ms());
+      }
+      if (device->push_pending || device->alive_pending) {
+        airq_snapshot_t snapshot;
+        airq_snapshot_read(device, &snapshot);
 
-      vdc_report(LOG_INFO, "Reporting new values from device %p: %s...\n", airq_device, airq_device->dsuidstring);
+        uint32_t due = push_governor_due(device, &snapshot, vdc_monotonic_ms());
+        if (!due) {
+          continue;
+        }
 
-      push_sensor_data();
+        vdc_report(LOG_DEBUG, "Main loop: airq_device %p: - dsuid %s - presentSignaled %s, announced %s\n",
+              vdcd, vdcd->dsuidstring,
+              vdcd->presentSignaled ? "yes" : "no",
+              vdcd->announced? "yes" : "no"); 
+
+        vdc_report(LOG_INFO, "Reporting new values from device %p: %s, slots 0x%x...\n", vdcd, vdcd->dsuidstring, due);
+
+        double push_start = vdc_monotonic_ms();
+        push_sensor_data(vdcd, &snapshot, due);
+        airq_metrics_observe(AIRQ_STAGE_PUSH, vdc_monotonic_ms() - push_start);
+        airq_metrics_count(AIRQ_COUNTER_PUSHES, 1);
+        airq_metrics_count(AIRQ_COUNTER_PUSHED_VALUES, __builtin_popcount(due));
+
+        // only a push of values the last poll changed measures the poll to push latency,
+        // alive signs and values held back by the governor would count their waiting time
+        if (changed & due) {
+          device->push_latency_ms = vdc_monotonic_ms() - snapshot.ready_ms;
+          airq_metrics_observe(AIRQ_STAGE_LATENCY, device->push_latency_ms);
+          if (device->push_latency_ms > device->push_latency_max_ms) {
+            device->push_latency_max_ms = device->push_latency_ms;
+          }
+          vdc_report(LOG_INFO, "poll to push latency of %s: %.1f ms (max %.1f ms)\n",
+              device->id, device->push_latency_ms, device->push_latency_max_ms);
+        }
+      }
     }
+  }
 
-    pthread_mutex_unlock(&g_network_mutex);
+  airq_query_stop();
+  airq_network_wakeup();
+  pthread_join(networkThreadId, NULL);
+  airq_network_cleanup();
+  airq_store_close();
+
+  airq_device_t* device;
+  airq_device_t* tmp;
+  LL_FOREACH_SAFE(airq.devices, device, tmp) {
+    for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
+      free(device->sensor_values[i].value_name);
+    }
+    free(device->id);
+    free(device->name);
+    free(device->ip);
+    free(device->password);
+    airq_history_free(device);
+    airq_aggregate_free(device);
+    free(device);
+  }
+
+  airq_vdcd_t* vtmp;
+  LL_FOREACH_SAFE(airq_devices, vdcd, vtmp) {
+    free(vdcd);
   }
-  
-  for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
-    sensor_value_t* value = &airq.device.sensor_values[i];    
-    free(value->value_name);    
-  } 
   
   free(airq_current_values);
   
   dsvdc_cleanup(handle);
   curl_global_cleanup();
-  pthread_join(networkThreadId, NULL);
-  pthread_mutex_destroy(&g_network_mutex);
+  close(g_notify_fd);
 
   return EXIT_SUCCESS;
 }
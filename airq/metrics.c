@@ -0,0 +1,255 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+#include <utlist.h>
+
+#include "airq.h"
+
+/*
+ * Counters and latency histograms of the poll and push stages. Recording is
+ * a few relaxed atomic additions in the thread that runs the stage, nothing
+ * is formatted or locked until somebody asks for the Prometheus text through
+ * the METRICS request of the query socket, or the network thread rewrites
+ * metrics_file for the textfile collector of the node exporter.
+ */
+
+#define METRICS_BUCKETS 16
+#define METRICS_READ_RETRIES 8
+
+/* per device values of render_devices() */
+enum {
+  DEVICE_REQUESTS,
+  DEVICE_CONNECTS,
+  DEVICE_REUSED,
+  DEVICE_ERRORS,
+  DEVICE_POLL_DELAY,
+  DEVICE_BREAKER,
+  DEVICE_PRESENT
+};
+
+/* upper bounds of the histogram buckets in seconds, the last bucket is +Inf */
+static const double bucket_bounds[METRICS_BUCKETS] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+  0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+typedef struct metrics_histogram {
+  atomic_ulong buckets[METRICS_BUCKETS + 1];
+  atomic_ullong sum_ns;
+} metrics_histogram_t;
+
+static metrics_histogram_t stages[AIRQ_STAGE_COUNT];
+static atomic_ulong counters[AIRQ_COUNTER_COUNT];
+
+static const char* stage_names[AIRQ_STAGE_COUNT] = {
+  [AIRQ_STAGE_CONNECT] = "connect",
+  [AIRQ_STAGE_FIRST_BYTE] = "first_byte",
+  [AIRQ_STAGE_TRANSFER] = "transfer",
+  [AIRQ_STAGE_DECODE] = "decode",
+  [AIRQ_STAGE_PARSE] = "parse",
+  [AIRQ_STAGE_PUBLISH] = "publish",
+  [AIRQ_STAGE_PUSH] = "push",
+  [AIRQ_STAGE_LATENCY] = "poll_to_push",
+  [AIRQ_STAGE_GETPROP] = "getprop"
+};
+
+static const struct {
+  const char* name;
+  const char* help;
+} counter_info[AIRQ_COUNTER_COUNT] = {
+  [AIRQ_COUNTER_POLLS] = { "airq_polls_total", "Polls of all AirQ devices" },
+  [AIRQ_COUNTER_POLL_FAILURES] = { "airq_poll_failures_total", "Polls that failed" },
+  [AIRQ_COUNTER_PUSHES] = { "airq_pushes_total", "Sensor state pushes to the vdSM" },
+  [AIRQ_COUNTER_PUSHED_VALUES] = { "airq_pushed_values_total", "Sensor values in all pushes" },
+  [AIRQ_COUNTER_GETPROP] = { "airq_getprop_total", "getProperty requests of the vdSM" },
+  [AIRQ_COUNTER_SETPROP] = { "airq_setprop_total", "setProperty requests of the vdSM" }
+};
+
+/* record the duration of a stage in milliseconds */
+void airq_metrics_observe(int stage, double ms) {
+  metrics_histogram_t* h = &stages[stage];
+  double seconds = ms / 1000;
+  int b = 0;
+
+  if (ms < 0) {
+    return;
+  }
+  while (b < METRICS_BUCKETS && seconds > bucket_bounds[b]) {
+    b++;
+  }
+  atomic_fetch_add_explicit(&h->buckets[b], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_ns, (unsigned long long) (ms * 1e6), memory_order_relaxed);
+}
+
+void airq_metrics_count(int counter, unsigned long n) {
+  atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+static unsigned long load(atomic_ulong* value) {
+  return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+/* compression of the history, read under history_seq like a HISTORY request */
+static double history_bytes_per_sample(airq_device_t* device, int slot) {
+  for (int retry = 0; retry < METRICS_READ_RETRIES; retry++) {
+    unsigned seq = atomic_load_explicit(&device->shared.history_seq, memory_order_acquire);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    double bytes = airq_history_bytes_per_sample(&device->sensor_values[slot].history);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&device->shared.history_seq, memory_order_relaxed) == seq) {
+      return bytes;
+    }
+  }
+  return 0;
+}
+
+static void render_histograms(FILE* out) {
+  fprintf(out, "# HELP airq_stage_duration_seconds Duration of the poll and push stages\n");
+  fprintf(out, "# TYPE airq_stage_duration_seconds histogram\n");
+
+  for (int s = 0; s < AIRQ_STAGE_COUNT; s++) {
+    metrics_histogram_t* h = &stages[s];
+    unsigned long count = 0;
+
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+      count += load(&h->buckets[b]);
+      if (b < METRICS_BUCKETS) {
+        fprintf(out, "airq_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+            stage_names[s], bucket_bounds[b], count);
+      } else {
+        fprintf(out, "airq_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stage_names[s], count);
+      }
+    }
+    fprintf(out, "airq_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s],
+        atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9);
+    fprintf(out, "airq_stage_duration_seconds_count{stage=\"%s\"} %lu\n", stage_names[s], count);
+  }
+}
+
+static void render_counters(FILE* out) {
+  for (int i = 0; i < AIRQ_COUNTER_COUNT; i++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_info[i].name, counter_info[i].help,
+        counter_info[i].name, counter_info[i].name, load(&counters[i]));
+  }
+}
+
+/* one gauge or counter family with a sample per device */
+static void render_devices(FILE* out, const char* name, const char* type, const char* help, int what) {
+  airq_device_t* device;
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  LL_FOREACH(airq.devices, device) {
+    airq_connection_t* conn = &device->conn;
+    unsigned long value = 0;
+
+    switch (what) {
+      case DEVICE_REQUESTS: value = load(&conn->requests); break;
+      case DEVICE_CONNECTS: value = load(&conn->connects); break;
+      case DEVICE_REUSED: value = load(&conn->reused); break;
+      case DEVICE_ERRORS: value = load(&conn->errors); break;
+      case DEVICE_POLL_DELAY: value = atomic_load_explicit(&device->poll_delay, memory_order_relaxed); break;
+      case DEVICE_BREAKER: value = atomic_load(&device->breaker); break;
+      case DEVICE_PRESENT: value = device->vdcd ? atomic_load(&device->vdcd->present) : 0; break;
+    }
+    fprintf(out, "%s{device=\"%s\"} %lu\n", name, device->id, value);
+  }
+}
+
+static void render_history(FILE* out) {
+  airq_device_t* device;
+
+  fprintf(out, "# HELP airq_history_bytes_per_sample Compressed size of a history sample\n");
+  fprintf(out, "# TYPE airq_history_bytes_per_sample gauge\n");
+  LL_FOREACH(airq.devices, device) {
+    for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+      fprintf(out, "airq_history_bytes_per_sample{device=\"%s\",sensor=\"%s\"} %.3f\n",
+          device->id, device->sensor_values[i].value_name, history_bytes_per_sample(device, i));
+    }
+  }
+}
+
+/* Prometheus text exposition of all metrics, the caller frees the result */
+char* airq_metrics_render(size_t* len) {
+  char* text = NULL;
+  FILE* out = open_memstream(&text, len);
+
+  if (out == NULL) {
+    return NULL;
+  }
+
+  render_histograms(out);
+  render_counters(out);
+  render_devices(out, "airq_http_requests_total", "counter", "HTTP requests sent to the device", DEVICE_REQUESTS);
+  render_devices(out, "airq_http_connects_total", "counter", "Requests that opened a new connection", DEVICE_CONNECTS);
+  render_devices(out, "airq_http_reused_total", "counter", "Requests served over a kept-alive connection", DEVICE_REUSED);
+  render_devices(out, "airq_http_errors_total", "counter", "Requests that failed on the transport level", DEVICE_ERRORS);
+  render_devices(out, "airq_poll_interval_seconds", "gauge", "Delay of the next poll as last scheduled", DEVICE_POLL_DELAY);
+  render_devices(out, "airq_breaker_state", "gauge", "Circuit breaker, 0 closed, 1 open, 2 half open", DEVICE_BREAKER);
+  render_devices(out, "airq_present", "gauge", "vdSD is reported as present", DEVICE_PRESENT);
+  render_history(out);
+
+  if (fclose(out) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/* replace metrics_file with the current text after a poll, called by the network thread */
+void airq_metrics_export() {
+  static bool failed = false;
+  size_t len;
+  char* text;
+  char* tmp;
+
+  if (g_metrics_file == NULL || g_metrics_file[0] == 0) {
+    return;
+  }
+  text = airq_metrics_render(&len);
+  tmp = malloc(strlen(g_metrics_file) + sizeof(".tmp"));
+  if (text == NULL || tmp == NULL) {
+    free(text);
+    free(tmp);
+    return;
+  }
+
+  /* the collector must never see a partial file, so write a temporary one and rename it */
+  strcpy(tmp, g_metrics_file);
+  strcat(tmp, ".tmp");
+  FILE* out = fopen(tmp, "w");
+  bool ok = out != NULL && fwrite(text, 1, len, out) == len;
+  if (out != NULL && fclose(out) != 0) {
+    ok = false;
+  }
+  if (ok && rename(tmp, g_metrics_file) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    if (!failed) {
+      vdc_report(LOG_WARNING, "metrics: cannot write %s: %s\n", g_metrics_file, strerror(errno));
+    }
+    unlink(tmp);
+  }
+  failed = !ok;
+
+  free(text);
+  free(tmp);
+}
@@ -13,7 +13,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <curl/curl.h>
 #include <json.h>
@@ -22,38 +26,28 @@
 #include <digitalSTROM/dsuid.h>
 #include <dsvdc/dsvdc.h>
 
-#include <openssl/evp.h>
 #include <math.h>
-#include <openssl/bio.h>
 
 #include "airq.h"
 
-struct memory_struct {
-  char *memory;
-  size_t size;
-};
-
 struct data {
   char trace_ascii; /* 1 or 0 */
 };
 
-struct curl_slist *cookielist;
+static CURLM *multi_handle = NULL;
+static int epoll_fd = -1;
+static airq_watch_t wakeup = { AIRQ_WATCH_WAKEUP, -1, NULL };
+static airq_watch_t curl_timer = { AIRQ_WATCH_CURL_TIMER, -1, NULL };
+static airq_watch_t* removed_watches = NULL;
+static atomic_bool poll_all_requested = false;   /* lock-free, set from the SIGHUP handler */
 
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-  size_t realsize = size * nmemb;
-  struct memory_struct *mem = (struct memory_struct *) userp;
-
-  mem->memory = realloc(mem->memory, mem->size + realsize + 1);
-  if (mem->memory == NULL) {
-    vdc_report(LOG_ERR, "network module: not enough memory (realloc returned NULL)\n");
-    return 0;
-  }
+  airq_device_t *device = (airq_device_t *) userp;
+  double start = vdc_monotonic_ms();
 
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = 0;
-  
-  return realsize;
+  size_t n = airq_stream_feed(device, contents, size * nmemb);
+  device->stream.decode_ms += vdc_monotonic_ms() - start;
+  return n;
 }
 
 static void DebugDump(const char *text, FILE *stream, unsigned char *ptr, size_t size, char nohex) {
@@ -148,83 +142,143 @@ int decodeURIComponent (char *sSource, char *sDest) {
   return nLength;
 }
 
-struct memory_struct* http_get(const char *url) {
-  CURL *curl;
-  CURLcode res;
-  struct memory_struct *chunk;
+static int airq_connection_open(airq_device_t* device) {
+  airq_connection_t* conn = &device->conn;
 
-  chunk = malloc(sizeof(struct memory_struct));
-  if (chunk == NULL) {
-    vdc_report(LOG_ERR, "network: not enough memory\n");
-    return NULL;
+  if (conn->curl != NULL) {
+    return AIRQ_OK;
   }
-  chunk->memory = malloc(1);
-  chunk->size = 0;
 
-  curl = curl_easy_init();
-  if (curl == NULL) {
+  conn->curl = curl_easy_init();
+  if (conn->curl == NULL) {
     vdc_report(LOG_ERR, "network: curl init failure\n");
-    free(chunk->memory);
-    free(chunk);
-    return NULL;
+    return AIRQ_CONNECT_FAILED;
   }
-      
-  struct curl_slist *headers = NULL;
 
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void * )chunk);
-  curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
+  snprintf(conn->url, sizeof(conn->url), "http://%s/data", device->ip);
 
-  
-  if (vdc_get_debugLevel() > LOG_DEBUG) {
-    struct data config;
-    config.trace_ascii = 1; /* enable ascii tracing */
+  curl_easy_setopt(conn->curl, CURLOPT_URL, conn->url);
+  curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+  curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, (void *) device);
+  curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, (void *) device);
+  curl_easy_setopt(conn->curl, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1L);
+
+  /* keep the connection to the AirQ open between polls */
+  curl_easy_setopt(conn->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(conn->curl, CURLOPT_TCP_KEEPIDLE, 60L);
+  curl_easy_setopt(conn->curl, CURLOPT_TCP_KEEPINTVL, 30L);
+  curl_easy_setopt(conn->curl, CURLOPT_MAXAGE_CONN, 3600L);
+
+  /* an unreachable AirQ must not hold the handle longer than this */
+  curl_easy_setopt(conn->curl, CURLOPT_CONNECTTIMEOUT, g_connect_timeout);
+  curl_easy_setopt(conn->curl, CURLOPT_TIMEOUT, g_request_timeout);
+
+  /* the DNS cache belongs to the multi handle and lives as long as the daemon,
+     resolve again now and then in case the AirQ got a new DHCP or mDNS address */
+  curl_easy_setopt(conn->curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+
+  vdc_report(LOG_INFO, "network: opened connection handle for %s\n", conn->url);
+  return AIRQ_OK;
+}
+
+static void airq_connection_close(airq_device_t* device) {
+  airq_connection_t* conn = &device->conn;
+
+  if (conn->curl != NULL) {
+    if (conn->busy) {
+      curl_multi_remove_handle(multi_handle, conn->curl);
+      conn->busy = false;
+    }
+    curl_easy_cleanup(conn->curl);
+    conn->curl = NULL;
+  }
+}
 
-    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, DebugCallback);
-    curl_easy_setopt(curl, CURLOPT_DEBUGDATA, &config);
+static struct data debug_config = { 1 };    /* enable ascii tracing */
+
+static int airq_request_start(airq_device_t* device) {
+  airq_connection_t* conn = &device->conn;
+
+  if (airq_connection_open(device) != AIRQ_OK) {
+    return AIRQ_CONNECT_FAILED;
+  }
+
+  airq_stream_begin(device);
+
+  if (vdc_get_debugLevel() > LOG_DEBUG) {
+    curl_easy_setopt(conn->curl, CURLOPT_DEBUGFUNCTION, DebugCallback);
+    curl_easy_setopt(conn->curl, CURLOPT_DEBUGDATA, &debug_config);
     /* the DEBUGFUNCTION has no effect until we enable VERBOSE */
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(conn->curl, CURLOPT_VERBOSE, 1L);
+  } else {
+    curl_easy_setopt(conn->curl, CURLOPT_VERBOSE, 0L);
   }
-  
-  res = curl_easy_perform(curl);
+
+  if (curl_multi_add_handle(multi_handle, conn->curl) != CURLM_OK) {
+    vdc_report(LOG_ERR, "network: cannot add request for %s\n", conn->url);
+    return AIRQ_CONNECT_FAILED;
+  }
+
+  conn->busy = true;
+  conn->requests++;
+  return AIRQ_OK;
+}
+
+/* detach a finished transfer, returns AIRQ_OK if the response has been decrypted completely */
+static int airq_request_finish(airq_device_t* device, CURLcode res) {
+  airq_connection_t* conn = &device->conn;
+
+  curl_multi_remove_handle(multi_handle, conn->curl);
+  conn->busy = false;
 
   if (res != CURLE_OK) {
-    vdc_report(LOG_ERR, "network: curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-    
-    if (chunk != NULL) {
-      if (chunk->memory != NULL) {
-        free(chunk->memory);
-      }
-      free(chunk);
-      chunk = NULL;
-    }
-  } else {
-    //vdc_report(LOG_ERR, "Response: %s\n", chunk->memory);    // results in segmentation fault if response is too long
-    res = curl_easy_getinfo(curl, CURLINFO_COOKIELIST, &cookielist);
+    vdc_report(LOG_ERR, "network: request to %s failed: %s\n", conn->url, curl_easy_strerror(res));
 
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    /* start over with a fresh handle and connection on the next poll */
+    conn->errors++;
+    airq_connection_close(device);
+    return AIRQ_CONNECT_FAILED;
+  }
 
-    if (response_code == 403 || response_code == 404 || response_code == 503) {
-      vdc_report(LOG_ERR, "AirQ server response: %d - ignoring response\n", response_code);
-      if (chunk != NULL) {
-        if (chunk->memory != NULL) {
-          free(chunk->memory);
-        }
-        free(chunk);
-        chunk = NULL;
-      }
-    } 
+  long new_connects = 0;
+  curl_easy_getinfo(conn->curl, CURLINFO_NUM_CONNECTS, &new_connects);
+  if (new_connects > 0) {
+    conn->connects++;
+  } else {
+    conn->reused++;
+  }
+
+  vdc_report(LOG_INFO, "network: connection %s: requests %lu, new connections %lu, reused %lu, errors %lu\n",
+      conn->url, atomic_load(&conn->requests), atomic_load(&conn->connects),
+      atomic_load(&conn->reused), atomic_load(&conn->errors));
+
+  /* curl times every phase from the start of the request, in seconds */
+  double connect_time = 0, first_byte_time = 0, total_time = 0;
+  curl_easy_getinfo(conn->curl, CURLINFO_CONNECT_TIME, &connect_time);
+  curl_easy_getinfo(conn->curl, CURLINFO_STARTTRANSFER_TIME, &first_byte_time);
+  curl_easy_getinfo(conn->curl, CURLINFO_TOTAL_TIME, &total_time);
+  if (new_connects > 0) {
+    airq_metrics_observe(AIRQ_STAGE_CONNECT, connect_time * 1000);
   }
+  airq_metrics_observe(AIRQ_STAGE_FIRST_BYTE, (first_byte_time - connect_time) * 1000);
+  airq_metrics_observe(AIRQ_STAGE_TRANSFER, total_time * 1000);
+
+  long response_code;
+  curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &response_code);
 
-  curl_slist_free_all(headers);
-  curl_easy_cleanup(curl);
+  if (response_code == 403 || response_code == 404 || response_code == 503) {
+    vdc_report(LOG_ERR, "AirQ server response: %ld - ignoring response\n", response_code);
+    return AIRQ_GETMEASURE_FAILED;
+  } 
 
-  return chunk;
+  double start = vdc_monotonic_ms();
+  int rc = airq_stream_end(device);
+  device->stream.decode_ms += vdc_monotonic_ms() - start;
+  return rc;
 }
 
-int parse_json_data(unsigned char* response ) {
+int parse_json_data(airq_device_t* device, unsigned char* response ) {
   bool changed_values = FALSE;
   time_t now;
     
@@ -238,8 +292,6 @@ int parse_json_data(unsigned char* response ) {
     return AIRQ_GETMEASURE_FAILED;
   }
 
-  //pthread_mutex_lock(&g_network_mutex);
-
   json_object_object_foreach(jobj, key, val) {
     enum json_type type = json_object_get_type(val);
     
@@ -251,7 +303,7 @@ int parse_json_data(unsigned char* response ) {
     } 
     
     
-    svalue = find_sensor_value_by_name(key);
+    svalue = find_sensor_value_by_name(device, key);
     if (svalue == NULL) {
       vdc_report(LOG_WARNING, "value %s is not configured for evaluation - ignoring\n", key);
     } else {
@@ -265,32 +317,20 @@ int parse_json_data(unsigned char* response ) {
         
           if (type == json_type_double) {
             vdc_report(LOG_WARNING, "network: getdata returned key: %s value: %f\n", key, json_object_get_double(jvalue));
-            
-            //if ((svalue->last_reported == 0) || (svalue->last_value != json_object_get_boolean(val)) || (now - svalue->last_reported) > 180) {
-            if ((svalue->last_reported == 0) || (svalue->last_value != json_object_get_double(jvalue))) {
+            if (sensor_value_update(device, svalue, json_object_get_double(jvalue), now)) {
               changed_values = TRUE;
             }
-            svalue->last_value = svalue->value;
-            svalue->value = json_object_get_double(jvalue);
-            svalue->last_query = now;
           } else if (type == json_type_int) {
             vdc_report(LOG_WARNING, "network: getdata returned key: %s value: %d\n", key, json_object_get_int(jvalue));
-            
-            //if ((svalue->last_reported == 0) || (svalue->last_value != json_object_get_boolean(val)) || (now - svalue->last_reported) > 180) {
-            if ((svalue->last_reported == 0) || (svalue->last_value != json_object_get_int(jvalue))) {
+            if (sensor_value_update(device, svalue, json_object_get_int(jvalue), now)) {
               changed_values = TRUE;
             }
-            svalue->last_value = svalue->value;
-            svalue->value = json_object_get_int(jvalue);
-            svalue->last_query = now;
           }
         }
       }
     }
   }
 
-	pthread_mutex_unlock(&g_network_mutex);
-  
   json_object_put(jobj);
    
   if (changed_values ) {
@@ -298,94 +338,311 @@ int parse_json_data(unsigned char* response ) {
   } else return 1;
 }
 
-uint8_t* base64_decode(const char* input) {
-    BIO* bio, * b64;
-    int decodeLen = (int)(strlen(input) * 3 / 4 + 1);
-    uint8_t* buffer = (uint8_t *)malloc(decodeLen);
-    memset(buffer, 0, decodeLen);
-       
-    bio = BIO_new_mem_buf(input, -1);
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_push(b64, bio);
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    decodeLen = BIO_read(bio, buffer, decodeLen);
-
-    BIO_free_all(bio);
-
-    return buffer;
+static void check_multi_info() {
+  CURLMsg *msg;
+  int msgs_left;
+  airq_device_t* device;
+  bool polled = false;
+
+  while ((msg = curl_multi_info_read(multi_handle, &msgs_left)) != NULL) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &device);
+
+    int rc = airq_request_finish(device, msg->data.result);
+    if (rc == AIRQ_OK) {
+      /* the streaming extractor runs inside the decoder, its share counts as parsing */
+      airq_metrics_observe(AIRQ_STAGE_DECODE, device->stream.decode_ms - device->extract.parse_ms);
+
+      double start = vdc_monotonic_ms();
+      if (g_json_validation) {
+        vdc_report(LOG_INFO, "network: decrypted: %s\n", device->stream.plain);
+        start = vdc_monotonic_ms();
+        rc = parse_json_data(device, (unsigned char *) device->stream.plain);
+      } else {
+        rc = airq_extract_end(device);
+      }
+      airq_metrics_observe(AIRQ_STAGE_PARSE, device->extract.parse_ms + vdc_monotonic_ms() - start);
+    }
+    if (rc == 0 || rc == 1) {
+      double start = vdc_monotonic_ms();
+      airq_history_append(device);
+      airq_snapshot_publish(device);
+      airq_metrics_observe(AIRQ_STAGE_PUBLISH, vdc_monotonic_ms() - start);
+    }
+    airq_values_received(device, rc);
+    polled = true;
+  }
+
+  if (polled) {
+    airq_metrics_export();
+  }
+}
+
+static void airq_poll_device(airq_device_t* device) {
+  if (device->conn.busy) {
+    return;
+  }
+  if (atomic_load(&device->breaker) == AIRQ_BREAKER_OPEN) {
+    atomic_store(&device->breaker, AIRQ_BREAKER_HALF_OPEN);
+  }
+  vdc_report(LOG_NOTICE, "network: reading AirQ values from %s\n", device->id);
+
+  if (airq_request_start(device) != AIRQ_OK) {
+    vdc_report(LOG_ERR, "network: getting airq values from %s failed\n", device->id);
+    airq_values_received(device, AIRQ_CONNECT_FAILED);
+  }
+}
+
+static void arm_timer(int fd, long timeout_ms) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (timeout_ms > 0) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  } else if (timeout_ms == 0) {
+    its.it_value.tv_nsec = 1;      /* as soon as possible, an all zero value would disarm */
+  }
+  timerfd_settime(fd, 0, &its, NULL);
 }
 
-unsigned char* decrypt(const char* msgb64, char* password) {
-    char airqpass[33] = {0};
-    strncpy(airqpass, password, 32);
-    if (strlen(airqpass) < 32) {
-        for (int i = strlen(airqpass); i < 32; i++) {
-            airqpass[i] = '0';
-        }
-    } else if (strlen(airqpass) > 32) {
-        airqpass[32] = '\0';
+static void watch_add(airq_watch_t* watch, uint32_t events) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = watch;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev) < 0) {
+    vdc_report(LOG_ERR, "network: epoll_ctl add failed: %s\n", strerror(errno));
+  }
+}
+
+/* curl tells which of its sockets to watch for which events */
+static int curl_socket_cb(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+  airq_watch_t* watch = (airq_watch_t *) socketp;
+  struct epoll_event ev;
+  (void) easy;
+  (void) userp;
+
+  if (what == CURL_POLL_REMOVE) {
+    if (watch) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL);
+      curl_multi_assign(multi_handle, s, NULL);
+      /* events of the running epoll batch may still point to it */
+      watch->type = AIRQ_WATCH_REMOVED;
+      LL_PREPEND(removed_watches, watch);
     }
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
 
-    char* key = (char*)airqpass;
+  if (watch == NULL) {
+    watch = malloc(sizeof(airq_watch_t));
+    if (watch == NULL) {
+      vdc_report(LOG_ERR, "network: not enough memory\n");
+      return -1;
+    }
+    watch->type = AIRQ_WATCH_SOCKET;
+    watch->fd = s;
+    watch->device = NULL;
+    watch->next = NULL;
+    curl_multi_assign(multi_handle, s, watch);
+    watch_add(watch, ev.events);
+  } else {
+    ev.data.ptr = watch;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev);
+  }
+  return 0;
+}
 
-    uint8_t* buffer = base64_decode(msgb64);
+static void free_removed_watches() {
+  airq_watch_t* watch;
+  airq_watch_t* tmp;
 
-    char* iv = malloc(16);
-    strncpy(iv, (char*)buffer, 16);
-    
-    uint8_t* ciphertext = (uint8_t*)(buffer + 16);
-    int ciphertext_len = (strlen(msgb64) / 4 * 3 ) - 16;
-
-    char* decrypted = malloc(ciphertext_len);
-    int decrypted_len = 0;
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
-    EVP_DecryptUpdate(ctx, decrypted, &decrypted_len, ciphertext, ciphertext_len);
-    EVP_CIPHER_CTX_free(ctx);
-
-    decrypted[decrypted_len] = '\0';
-    free(buffer);
-      
-    return decrypted;
+  LL_FOREACH_SAFE(removed_watches, watch, tmp) {
+    free(watch);
+  }
+  removed_watches = NULL;
 }
 
-int airq_get_values() {
-  int rc;
-  
-  vdc_report(LOG_NOTICE, "network: reading AirQ values\n");
+static int curl_timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+  (void) multi;
+  (void) userp;
 
-  char request_url[30];
-  strcpy(request_url, "http://");
-  strcat(request_url, airq.device.ip);
-  strcat(request_url, "/data");  
-  
-  struct memory_struct *response = http_get(request_url);
-  
-  if (response == NULL) {
-    vdc_report(LOG_ERR, "network: getting airq values failed\n");
+  arm_timer(curl_timer.fd, timeout_ms);
+  return 0;
+}
+
+int airq_network_init() {
+  airq_device_t* device;
+
+  /* jitter of the retry delays */
+  srandom(time(NULL) ^ getpid());
+
+  multi_handle = curl_multi_init();
+  if (multi_handle == NULL) {
+    vdc_report(LOG_ERR, "network: curl multi init failure\n");
     return AIRQ_CONNECT_FAILED;
   }
-  
-  vdc_report(LOG_INFO, "network: response: %s\n", response->memory);
-  json_object *jobj = json_tokener_parse(response->memory);
-  
-  if (NULL == jobj) {
-    vdc_report(LOG_ERR, "network: parsing json data failed, data:\n%s\n", response);
-    return AIRQ_GETMEASURE_FAILED;
+
+  /* keep one pooled connection per device alive */
+  curl_multi_setopt(multi_handle, CURLMOPT_MAXCONNECTS, (long) (airq.count + 1));
+  curl_multi_setopt(multi_handle, CURLMOPT_SOCKETFUNCTION, curl_socket_cb);
+  curl_multi_setopt(multi_handle, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  curl_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd < 0 || wakeup.fd < 0 || curl_timer.fd < 0) {
+    vdc_report(LOG_ERR, "network: cannot set up event loop: %s\n", strerror(errno));
+    return AIRQ_CONNECT_FAILED;
+  }
+  watch_add(&wakeup, EPOLLIN);
+  watch_add(&curl_timer, EPOLLIN);
+
+  /* one timer per device, fires at its next poll deadline */
+  LL_FOREACH(airq.devices, device) {
+    device->timer.type = AIRQ_WATCH_DEVICE;
+    device->timer.device = device;
+    device->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (device->timer.fd < 0) {
+      vdc_report(LOG_ERR, "network: cannot create poll timer for %s: %s\n", device->id, strerror(errno));
+      return AIRQ_CONNECT_FAILED;
+    }
+    watch_add(&device->timer, EPOLLIN);
   }
 
-  json_object_object_foreach(jobj, key, val) {
-    if (strcmp(key, "content") == 0) {
-      unsigned char* decrypted = decrypt(json_object_get_string(val), airq.device.password);
-      vdc_report(LOG_INFO, "network: decrypted: %s\n", decrypted);
-      rc = parse_json_data(decrypted);
-    } 
+  return AIRQ_OK;
+}
+
+void airq_network_cleanup() {
+  airq_device_t* device;
+
+  LL_FOREACH(airq.devices, device) {
+    airq_connection_close(device);
+    airq_stream_free(device);
+    if (device->timer.fd >= 0) {
+      close(device->timer.fd);
+    }
   }
-  
+  if (multi_handle != NULL) {
+    curl_multi_cleanup(multi_handle);
+    multi_handle = NULL;
+  }
+  free_removed_watches();
+  if (curl_timer.fd >= 0) {
+    close(curl_timer.fd);
+  }
+  if (wakeup.fd >= 0) {
+    close(wakeup.fd);
+  }
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+  }
+}
 
-  free(response->memory);
-  free(response);
-  
-  return rc;  
+/* (re)arm the poll timer of a device, delay in seconds */
+void airq_network_schedule(airq_device_t* device, time_t delay) {
+  device->query_time = time(NULL) + delay;
+  atomic_store_explicit(&device->poll_delay, delay > 0 ? delay : 0, memory_order_relaxed);
+  arm_timer(device->timer.fd, delay > 0 ? delay * 1000 : 0);
+}
+
+/* wake the network thread, safe to call from other threads and signal handlers */
+void airq_network_wakeup() {
+  uint64_t one = 1;
+  ssize_t ret = write(wakeup.fd, &one, sizeof(one));
+  (void) ret;
 }
 
+/* poll a device right away */
+void airq_network_poll_now(airq_device_t* device) {
+  atomic_store(&device->poll_requested, true);
+  airq_network_wakeup();
+}
+
+/* poll all devices right away, safe to call from signal handlers */
+void airq_network_poll_all() {
+  atomic_store(&poll_all_requested, true);
+  airq_network_wakeup();
+}
+
+/*
+ * Event loop of the network thread. It sleeps in epoll_wait() until a device
+ * poll timer expires, curl has socket activity or a timeout, or somebody
+ * wakes the thread. Transfers of all devices run concurrently on the multi
+ * handle and every device is evaluated as soon as its own transfer completes.
+ */
+void airq_network_run() {
+  struct epoll_event events[16];
+  airq_device_t* device;
+  uint64_t count;
+  int running;
+
+  LL_FOREACH(airq.devices, device) {
+    airq_network_schedule(device, 0);
+  }
+
+  while (!g_shutdown_flag) {
+    int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      vdc_report(LOG_ERR, "network: epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      airq_watch_t* watch = (airq_watch_t *) events[i].data.ptr;
+
+      switch (watch->type) {
+        case AIRQ_WATCH_WAKEUP:
+          if (read(watch->fd, &count, sizeof(count)) < 0) {
+            break;
+          }
+          bool all = atomic_exchange(&poll_all_requested, false);
+          LL_FOREACH(airq.devices, device) {
+            if (atomic_exchange(&device->poll_requested, false) || all) {
+              airq_poll_device(device);
+            }
+          }
+          break;
+
+        case AIRQ_WATCH_DEVICE:
+          if (read(watch->fd, &count, sizeof(count)) < 0) {
+            break;
+          }
+          airq_poll_device(watch->device);
+          break;
+
+        case AIRQ_WATCH_CURL_TIMER:
+          if (read(watch->fd, &count, sizeof(count)) < 0) {
+            break;
+          }
+          curl_multi_socket_action(multi_handle, CURL_SOCKET_TIMEOUT, 0, &running);
+          break;
+
+        case AIRQ_WATCH_SOCKET: {
+          int flags = 0;
+          if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+          if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+          if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+          curl_multi_socket_action(multi_handle, watch->fd, flags, &running);
+          break;
+        }
+
+        case AIRQ_WATCH_REMOVED:
+          break;
+      }
+    }
+
+    /* finishing transfers may close connections, their watches go away after the batch */
+    check_multi_info();
+    free_removed_watches();
+  }
+}
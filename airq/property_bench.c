@@ -0,0 +1,123 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * Benchmark of the property dispatch: lookups per second of the gperf table
+ * behind getprop and setprop, next to a chain of strcmp() over the same names
+ * as the callbacks had before. Checks that every name resolves to its own
+ * index, unknown names to -1 and wildcards to what getprop expects first,
+ * exits with 1 otherwise.
+ *
+ *   property-bench [rounds]
+ */
+
+#define BENCH_ROUNDS 200000
+
+/* names in the order of the AIRQ_PROP_* enum */
+static const char* names[AIRQ_PROP_COUNT] = {
+  "hardwareGuid", "displayId", "implementationId", "modelGuid", "capabilities",
+  "primaryGroup", "zoneID", "buttonInputDescriptions", "buttonInputSettings",
+  "dynamicActionDescriptions", "outputDescription", "outputSettings",
+  "channelDescriptions", "channelSettings", "channelStates", "deviceStates",
+  "deviceProperties", "devicePropertyDescriptions", "customActions",
+  "binaryInputDescriptions", "binaryInputSettings", "binaryInputStates",
+  "sensorDescriptions", "sensorSettings", "sensorStates", "name", "type", "model",
+  "modelFeatures", "modelUID", "modelVersion", "deviceClass", "deviceClassVersion",
+  "oemGuid", "oemModelGuid", "vendorId", "vendorName", "vendorGuid",
+  "hardwareVersion", "configURL", "hardwareModelGuid", "deviceIcon16",
+  "deviceIcon48", "deviceIconName"
+};
+
+static const char* unknown[] = {
+  "", "n", "names", "zoneId", "sensorState", "deviceIcon", "x-p44-foo", "progMode"
+};
+
+/* the dispatch before the gperf table, one strcmp() per known name */
+static int strcmp_id(const char* name) {
+  for (int i = 0; i < AIRQ_PROP_COUNT; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int check() {
+  int errors = 0;
+
+  for (int i = 0; i < AIRQ_PROP_COUNT; i++) {
+    if (airq_property_id(names[i]) != i) {
+      fprintf(stderr, "%s resolves to %d, expected %d\n", names[i], airq_property_id(names[i]), i);
+      errors++;
+    }
+  }
+  for (size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+    if (airq_property_id(unknown[i]) != -1) {
+      fprintf(stderr, "unknown name \"%s\" resolves to %d\n", unknown[i], airq_property_id(unknown[i]));
+      errors++;
+    }
+  }
+
+  /* a wildcard ends the answer of the vDC and is skipped by a vdSD */
+  if (airq_property_dispatch(NULL, true) != AIRQ_PROP_STOP) {
+    fprintf(stderr, "wildcard query of the vDC does not stop\n");
+    errors++;
+  }
+  if (airq_property_dispatch(NULL, false) != -1) {
+    fprintf(stderr, "wildcard query of a vdSD is not skipped\n");
+    errors++;
+  }
+  if (airq_property_dispatch("zoneID", true) != AIRQ_PROP_ZONE_ID || airq_property_dispatch("zoneID", false) != AIRQ_PROP_ZONE_ID) {
+    fprintf(stderr, "zoneID is not dispatched in both scopes\n");
+    errors++;
+  }
+  return errors;
+}
+
+static void run(const char* what, int (*lookup)(const char*), const char** list, size_t n, unsigned long rounds) {
+  volatile int sink = 0;
+
+  double start = vdc_monotonic_ms();
+  for (unsigned long r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      sink += lookup(list[i]);
+    }
+  }
+  double ms = vdc_monotonic_ms() - start;
+
+  printf("%-24s %8.1f ns/lookup\n", what, ms * 1e6 / ((double) rounds * n));
+}
+
+int main(int argc, char** argv) {
+  unsigned long rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_ROUNDS;
+  size_t nunknown = sizeof(unknown) / sizeof(unknown[0]);
+
+  if (rounds == 0) {
+    fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+    return 2;
+  }
+  if (check() != 0) {
+    return 1;
+  }
+
+  printf("%lu rounds over %d known and %zu unknown names\n", rounds, AIRQ_PROP_COUNT, nunknown);
+  run("gperf, known names", airq_property_id, names, AIRQ_PROP_COUNT, rounds);
+  run("strcmp, known names", strcmp_id, names, AIRQ_PROP_COUNT, rounds);
+  run("gperf, unknown names", airq_property_id, unknown, nunknown, rounds);
+  run("strcmp, unknown names", strcmp_id, unknown, nunknown, rounds);
+  return 0;
+}
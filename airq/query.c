@@ -0,0 +1,546 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+#include <utlist.h>
+
+#include "airq.h"
+
+/*
+ * Local query interface on a Unix domain socket, served by its own epoll
+ * thread. It only reads what the network thread publishes: the snapshot and
+ * the aggregates under their sequence counter, the history blocks under
+ * history_seq. Responses are formatted straight into a per-client buffer
+ * that is sent from there and reused for the next request.
+ *
+ * Requests are single lines, answers start with "OK" and end with a line
+ * holding a single ".", errors are a single line starting with "ERR".
+ * Pipelined requests are answered one after the other, the next one waits
+ * and the socket is not read until the client has taken the last answer:
+ *
+ *   DEVICES                                  id name ip present breaker
+ *   CURRENT <device>                         index name value time
+ *   HISTORY <device> <sensor> [from [to]]    time value
+ *   AGGREGATE <device> <sensor> [window]     window count min max mean p50 p90 p95
+ *   METRICS                                  Prometheus text, see metrics.c
+ *
+ * A sensor is given by its index or value name, times are unix timestamps
+ * and windows are given in seconds (60, 900, 3600).
+ */
+
+#define QUERY_MAX_CLIENTS 512
+#define QUERY_LINE_MAX 256
+#define QUERY_OUT_INITIAL 4096
+#define QUERY_READ_RETRIES 8
+
+typedef struct query_client {
+  int fd;
+  struct query_client *prev;
+  struct query_client *next;
+  char in[QUERY_LINE_MAX];
+  size_t in_len;
+  char *out;
+  size_t out_size;
+  size_t out_len;
+  size_t out_sent;
+  bool writing;               /* EPOLLOUT is armed instead of EPOLLIN */
+  bool failed;                /* the response did not fit into memory */
+} query_client_t;
+
+static int query_epoll = -1;
+static query_client_t listener = { .fd = -1 };
+static query_client_t stopper = { .fd = -1 };
+static query_client_t* clients = NULL;
+static int nclients = 0;
+static pthread_t query_thread;
+static bool query_running = false;
+
+/* append to the client's output buffer, growing it if needed */
+static void out_printf(query_client_t* c, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void out_printf(query_client_t* c, const char* fmt, ...) {
+  va_list args;
+
+  while (!c->failed) {
+    size_t room = c->out_size - c->out_len;
+
+    va_start(args, fmt);
+    int n = vsnprintf(c->out + c->out_len, room, fmt, args);
+    va_end(args);
+    if (n < 0) {
+      c->failed = true;
+      return;
+    }
+    if ((size_t) n < room) {
+      c->out_len += n;
+      return;
+    }
+
+    size_t size = c->out_size * 2;
+    while (size - c->out_len <= (size_t) n) {
+      size *= 2;
+    }
+    char* out = realloc(c->out, size);
+    if (out == NULL) {
+      c->failed = true;
+      return;
+    }
+    c->out = out;
+    c->out_size = size;
+  }
+}
+
+static airq_device_t* query_device(const char* id) {
+  airq_device_t* device;
+
+  if (id == NULL) {
+    return NULL;
+  }
+  LL_FOREACH(airq.devices, device) {
+    if (strcasecmp(device->id, id) == 0) {
+      return device;
+    }
+  }
+  return NULL;
+}
+
+static int query_sensor(airq_device_t* device, const char* name) {
+  char* end;
+
+  if (name == NULL) {
+    return -1;
+  }
+  long idx = strtol(name, &end, 10);
+  if (*end == 0) {
+    return (idx >= 0 && idx < MAX_SENSOR_VALUES && device->sensor_values[idx].is_active) ? (int) idx : -1;
+  }
+  sensor_value_t* svalue = find_sensor_value_by_name(device, name);
+  return svalue ? (int) (svalue - device->sensor_values) : -1;
+}
+
+static void query_devices(query_client_t* c) {
+  airq_device_t* device;
+
+  out_printf(c, "OK\n");
+  LL_FOREACH(airq.devices, device) {
+    out_printf(c, "%s %s %s %d %d\n", device->id, device->name ? device->name : "-", device->ip,
+        device->vdcd ? (int) device->vdcd->present : 0, atomic_load(&device->breaker));
+  }
+  out_printf(c, ".\n");
+}
+
+static void query_current(query_client_t* c, airq_device_t* device) {
+  airq_snapshot_t snapshot;
+
+  airq_snapshot_read(device, &snapshot);
+  out_printf(c, "OK\n");
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    out_printf(c, "%d %s %.10g %ld\n", i, device->sensor_values[i].value_name,
+        snapshot.values[i].value, (long) snapshot.values[i].last_query);
+  }
+  out_printf(c, ".\n");
+}
+
+static void query_history(query_client_t* c, airq_device_t* device, int slot, time_t from, time_t to) {
+  const airq_history_t* h = &device->sensor_values[slot].history;
+  size_t start = c->out_len;
+
+  /* decode straight into the response, start over if the network thread appended meanwhile */
+  for (int retry = 0; retry < QUERY_READ_RETRIES; retry++) {
+    unsigned seq1 = atomic_load_explicit(&device->shared.history_seq, memory_order_acquire);
+    if (seq1 & 1) {
+      sched_yield();
+      continue;
+    }
+
+    airq_history_iter_t it;
+    time_t time;
+    double value;
+
+    c->out_len = start;
+    out_printf(c, "OK\n");
+    airq_history_iter_init(&it, h);
+    while (airq_history_next(&it, &time, &value)) {
+      if (time < from) {
+        continue;
+      }
+      if (time > to) {
+        break;
+      }
+      out_printf(c, "%ld %.10g\n", (long) time, value);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&device->shared.history_seq, memory_order_relaxed) == seq1) {
+      out_printf(c, ".\n");
+      return;
+    }
+  }
+
+  c->out_len = start;
+  out_printf(c, "ERR history busy, try again\n");
+}
+
+static void query_aggregate(query_client_t* c, airq_device_t* device, int slot, long window) {
+  airq_stats_t stats;
+  bool found = false;
+
+  for (int k = 0; k < AIRQ_WINDOWS; k++) {
+    if (window != 0 && window != airq_aggregate_spans[k]) {
+      continue;
+    }
+    if (!found) {
+      out_printf(c, "OK\n");
+      found = true;
+    }
+    airq_stats_read(device, slot, k, &stats);
+    out_printf(c, "%ld %u %.10g %.10g %.10g %.10g %.10g %.10g\n", (long) airq_aggregate_spans[k], stats.count,
+        stats.min, stats.max, stats.mean, stats.p50, stats.p90, stats.p95);
+  }
+
+  if (found) {
+    out_printf(c, ".\n");
+  } else {
+    out_printf(c, "ERR unknown window %ld\n", window);
+  }
+}
+
+static void query_metrics(query_client_t* c) {
+  size_t len;
+  char* text = airq_metrics_render(&len);
+
+  if (text == NULL) {
+    out_printf(c, "ERR out of memory\n");
+    return;
+  }
+  out_printf(c, "OK\n%s.\n", text);
+  free(text);
+}
+
+static void query_request(query_client_t* c, char* line) {
+  char* save;
+  char* cmd = strtok_r(line, " \t\r", &save);
+  char* arg1 = strtok_r(NULL, " \t\r", &save);
+  char* arg2 = strtok_r(NULL, " \t\r", &save);
+  char* arg3 = strtok_r(NULL, " \t\r", &save);
+  char* arg4 = strtok_r(NULL, " \t\r", &save);
+
+  if (cmd == NULL) {
+    return;
+  }
+  if (strcasecmp(cmd, "DEVICES") == 0) {
+    query_devices(c);
+    return;
+  }
+  if (strcasecmp(cmd, "METRICS") == 0) {
+    query_metrics(c);
+    return;
+  }
+
+  airq_device_t* device = query_device(arg1);
+  if (device == NULL) {
+    out_printf(c, "ERR unknown device\n");
+    return;
+  }
+
+  if (strcasecmp(cmd, "CURRENT") == 0) {
+    query_current(c, device);
+    return;
+  }
+
+  int slot = query_sensor(device, arg2);
+  if (slot < 0) {
+    out_printf(c, "ERR unknown sensor\n");
+    return;
+  }
+
+  if (strcasecmp(cmd, "HISTORY") == 0) {
+    time_t from = arg3 ? strtol(arg3, NULL, 10) : 0;
+    time_t to = arg4 ? strtol(arg4, NULL, 10) : time(NULL);
+    query_history(c, device, slot, from, to);
+  } else if (strcasecmp(cmd, "AGGREGATE") == 0) {
+    query_aggregate(c, device, slot, arg3 ? strtol(arg3, NULL, 10) : 0);
+  } else {
+    out_printf(c, "ERR unknown request %s\n", cmd);
+  }
+}
+
+static void client_close(query_client_t* c) {
+  epoll_ctl(query_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  DL_DELETE(clients, c);
+  free(c->out);
+  free(c);
+  nclients--;
+}
+
+/* send what is pending, returns false if the client is gone */
+static bool client_flush(query_client_t* c) {
+  while (c->out_sent < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    c->out_sent += n;
+  }
+
+  bool pending = c->out_sent < c->out_len;
+  if (!pending) {
+    c->out_len = c->out_sent = 0;
+  }
+  if (pending != c->writing) {
+    /* a client that does not take its answer is not read either */
+    struct epoll_event ev = { .events = pending ? EPOLLOUT : EPOLLIN, .data.ptr = c };
+    epoll_ctl(query_epoll, EPOLL_CTL_MOD, c->fd, &ev);
+    c->writing = pending;
+  }
+  return true;
+}
+
+/* answer the complete lines of the input, the next one only when the last answer is sent */
+static bool client_process(query_client_t* c) {
+  char* line = c->in;
+  char* nl;
+
+  while (!c->writing && (nl = memchr(line, '\n', c->in_len - (line - c->in))) != NULL) {
+    *nl = 0;
+    query_request(c, line);
+    line = nl + 1;
+
+    if (c->failed) {
+      /* no partial answer, the request is known to be complete when it is sent */
+      static const char error[] = "ERR out of memory\n";
+      vdc_report(LOG_WARNING, "query: out of memory for a response, closing the client\n");
+      c->out_len = c->out_sent;
+      if (c->out_size - c->out_len >= sizeof(error) - 1) {
+        memcpy(c->out + c->out_len, error, sizeof(error) - 1);
+        c->out_len += sizeof(error) - 1;
+      }
+      client_flush(c);
+      return false;
+    }
+    if (!client_flush(c)) {
+      return false;
+    }
+  }
+  c->in_len -= line - c->in;
+  memmove(c->in, line, c->in_len);
+
+  if (!c->writing && c->in_len == sizeof(c->in)) {
+    out_printf(c, "ERR request too long\n");
+    c->in_len = 0;
+    return client_flush(c);
+  }
+  return true;
+}
+
+static bool client_read(query_client_t* c) {
+  while (!c->writing) {
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    c->in_len += n;
+
+    if (!client_process(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void client_accept() {
+  while (1) {
+    int fd = accept(listener.fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        vdc_report(LOG_WARNING, "query: accept failed: %s\n", strerror(errno));
+      }
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (nclients >= QUERY_MAX_CLIENTS) {
+      close(fd);
+      continue;
+    }
+
+    query_client_t* c = calloc(1, sizeof(query_client_t));
+    if (c == NULL || (c->out = malloc(QUERY_OUT_INITIAL)) == NULL) {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->out_size = QUERY_OUT_INITIAL;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(query_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      free(c->out);
+      free(c);
+      continue;
+    }
+    DL_APPEND(clients, c);
+    nclients++;
+  }
+}
+
+static void* query_run(void* arg __attribute__((unused))) {
+  struct epoll_event events[64];
+
+  while (1) {
+    int n = epoll_wait(query_epoll, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      vdc_report(LOG_ERR, "query: epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      query_client_t* c = events[i].data.ptr;
+
+      if (c == &stopper) {
+        return NULL;
+      }
+      if (c == &listener) {
+        client_accept();
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        client_close(c);
+        continue;
+      }
+      /* once the answer is out, go on with requests that arrived in the meantime */
+      if ((events[i].events & EPOLLOUT) && (!client_flush(c) || !client_process(c))) {
+        client_close(c);
+        continue;
+      }
+      if ((events[i].events & EPOLLIN) && !client_read(c)) {
+        client_close(c);
+      }
+    }
+  }
+  return NULL;
+}
+
+int airq_query_start() {
+  struct sockaddr_un addr;
+
+  if (g_query_socket == NULL || g_query_socket[0] == 0) {
+    return AIRQ_OK;
+  }
+  if (strlen(g_query_socket) >= sizeof(addr.sun_path)) {
+    vdc_report(LOG_ERR, "query: socket path %s is too long\n", g_query_socket);
+    return AIRQ_BAD_CONFIG;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, g_query_socket);
+  unlink(g_query_socket);
+
+  listener.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener.fd < 0 ||
+      bind(listener.fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      listen(listener.fd, 128) < 0) {
+    vdc_report(LOG_ERR, "query: cannot listen on %s: %s\n", g_query_socket, strerror(errno));
+    goto fail;
+  }
+
+  query_epoll = epoll_create1(EPOLL_CLOEXEC);
+  stopper.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (query_epoll < 0 || stopper.fd < 0) {
+    vdc_report(LOG_ERR, "query: epoll setup failed: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listener };
+  epoll_ctl(query_epoll, EPOLL_CTL_ADD, listener.fd, &ev);
+  ev.data.ptr = &stopper;
+  epoll_ctl(query_epoll, EPOLL_CTL_ADD, stopper.fd, &ev);
+
+  if (pthread_create(&query_thread, NULL, &query_run, NULL) != 0) {
+    vdc_report(LOG_ERR, "query: thread initialization failed\n");
+    goto fail;
+  }
+  query_running = true;
+
+  vdc_report(LOG_NOTICE, "query: listening on %s\n", g_query_socket);
+  return AIRQ_OK;
+
+fail:
+  if (listener.fd >= 0) {
+    close(listener.fd);
+    listener.fd = -1;
+  }
+  if (stopper.fd >= 0) {
+    close(stopper.fd);
+    stopper.fd = -1;
+  }
+  if (query_epoll >= 0) {
+    close(query_epoll);
+    query_epoll = -1;
+  }
+  return AIRQ_BAD_CONFIG;
+}
+
+void airq_query_stop() {
+  if (!query_running) {
+    return;
+  }
+
+  uint64_t one = 1;
+  ssize_t ret = write(stopper.fd, &one, sizeof(one));
+  (void) ret;
+  pthread_join(query_thread, NULL);
+  query_running = false;
+
+  /* the thread is gone, the remaining clients can be closed from here */
+  query_client_t* c;
+  query_client_t* tmp;
+  DL_FOREACH_SAFE(clients, c, tmp) {
+    client_close(c);
+  }
+
+  close(listener.fd);
+  close(stopper.fd);
+  close(query_epoll);
+  unlink(g_query_socket);
+  listener.fd = stopper.fd = query_epoll = -1;
+}
@@ -0,0 +1,81 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+
+#include "airq.h"
+
+/*
+ * Sensor values shared between the network thread and the dsvdc callbacks.
+ * The network thread is the only writer and publishes every complete poll
+ * result under a sequence counter; readers copy the snapshot and retry if a
+ * publish overlapped their copy. Neither side ever blocks the other.
+ * The window aggregates are published together with the values.
+ */
+
+void airq_snapshot_publish(airq_device_t* device) {
+  airq_shared_t* shared = &device->shared;
+  unsigned seq = atomic_load_explicit(&shared->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&shared->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  for (int i = 0; i < MAX_SENSOR_VALUES; i++) {
+    shared->snapshot.values[i].value = device->sensor_values[i].value;
+    shared->snapshot.values[i].last_query = device->sensor_values[i].last_query;
+  }
+  shared->snapshot.time = time(NULL);
+  shared->snapshot.ready_ms = vdc_monotonic_ms();
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+    for (int k = 0; k < AIRQ_WINDOWS; k++) {
+      airq_aggregate_get(&device->sensor_values[i], k, shared->snapshot.time, &shared->stats[i][k]);
+    }
+  }
+
+  atomic_store_explicit(&shared->seq, seq + 2, memory_order_release);
+
+  /* hand the changed slots over to the main loop, they accumulate until pushed */
+  atomic_fetch_or(&shared->dirty, device->dirty);
+  device->dirty = 0;
+}
+
+/* take the slots changed since the last call */
+uint32_t airq_snapshot_take_dirty(airq_device_t* device) {
+  return atomic_exchange(&device->shared.dirty, 0);
+}
+
+void airq_snapshot_read(airq_device_t* device, airq_snapshot_t* snapshot) {
+  airq_shared_t* shared = &device->shared;
+  unsigned seq1, seq2;
+
+  do {
+    seq1 = atomic_load_explicit(&shared->seq, memory_order_acquire);
+    memcpy(snapshot, &shared->snapshot, sizeof(airq_snapshot_t));
+    atomic_thread_fence(memory_order_acquire);
+    seq2 = atomic_load_explicit(&shared->seq, memory_order_relaxed);
+  } while ((seq1 & 1) || seq1 != seq2);
+}
+
+void airq_stats_read(airq_device_t* device, int slot, int k, airq_stats_t* stats) {
+  airq_shared_t* shared = &device->shared;
+  unsigned seq1, seq2;
+
+  do {
+    seq1 = atomic_load_explicit(&shared->seq, memory_order_acquire);
+    memcpy(stats, &shared->stats[slot][k], sizeof(airq_stats_t));
+    atomic_thread_fence(memory_order_acquire);
+    seq2 = atomic_load_explicit(&shared->seq, memory_order_relaxed);
+  } while ((seq1 & 1) || seq1 != seq2);
+}
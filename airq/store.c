@@ -0,0 +1,338 @@
+/*
+ Author: Alexander Knauer <a-x-e@gmx.net>
+ License: Apache 2.0
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <digitalSTROM/dsuid.h>
+#include <dsvdc/dsvdc.h>
+#include <utlist.h>
+
+#include "airq.h"
+
+/*
+ * Persistent history next to airq.cfg. The file is a header followed by a
+ * fixed number of 32 byte records, mapped into memory and written as a
+ * circular log by the network thread. Every record carries a sequence number
+ * and a CRC32, so a record torn by a crash is simply skipped. At startup the
+ * valid records are replayed in sequence order into the history rings and
+ * the last known values, before any network access.
+ */
+
+#define STORE_MAGIC "AIRQHST1"
+#define STORE_MIN_RECORDS 1024
+
+typedef struct store_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t records;
+  uint32_t reserved[3];
+  uint32_t crc;
+} store_header_t;
+
+typedef struct store_record {
+  uint32_t device;            /* hash of the device id */
+  uint32_t key;               /* hash of the sensor value name */
+  uint32_t seq;
+  uint32_t crc;               /* CRC32 of all other fields */
+  int64_t time;
+  double value;
+} store_record_t;
+
+static int store_fd = -1;
+static void* store_map = NULL;
+static size_t store_size = 0;
+static store_record_t* records = NULL;
+static uint32_t capacity = 0;
+static uint32_t head = 0;
+static uint32_t synced = 0;         /* head at the last airq_store_sync() */
+static size_t page_size = 4096;
+static uint32_t seq = 0;
+static uint32_t crc_table[256];
+
+static void crc32_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+  const unsigned char* p = data;
+
+  crc = ~crc;
+  while (len--) {
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint32_t record_crc(const store_record_t* r) {
+  uint32_t crc = crc32_update(0, r, offsetof(store_record_t, crc));
+  return crc32_update(crc, &r->time, sizeof(store_record_t) - offsetof(store_record_t, time));
+}
+
+static uint32_t name_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char) tolower((unsigned char) *name)) * 16777619u;
+  }
+  return hash ? hash : 1;
+}
+
+static char* store_path() {
+  const char* slash;
+  char* path;
+
+  if (g_history_file != NULL) {
+    return strdup(g_history_file);
+  }
+
+  /* airq.history in the folder of the configuration file */
+  slash = strrchr(g_cfgfile, '/');
+  size_t dirlen = slash ? (size_t) (slash - g_cfgfile + 1) : 0;
+  path = malloc(dirlen + sizeof("airq.history"));
+  if (path) {
+    memcpy(path, g_cfgfile, dirlen);
+    strcpy(path + dirlen, "airq.history");
+  }
+  return path;
+}
+
+/* a header written by this or another configuration */
+static bool header_intact(const store_header_t* h) {
+  return memcmp(h->magic, STORE_MAGIC, sizeof(h->magic)) == 0 &&
+      h->crc == crc32_update(0, h, offsetof(store_header_t, crc));
+}
+
+static bool header_valid(const store_header_t* h) {
+  return header_intact(h) && h->record_size == sizeof(store_record_t) && h->records == capacity;
+}
+
+static void header_write(store_header_t* h) {
+  memset(h, 0, sizeof(store_header_t));
+  memcpy(h->magic, STORE_MAGIC, sizeof(h->magic));
+  h->record_size = sizeof(store_record_t);
+  h->records = capacity;
+  h->crc = crc32_update(0, h, offsetof(store_header_t, crc));
+}
+
+static void store_replay_record(const store_record_t* r) {
+  airq_device_t* device;
+
+  LL_FOREACH(airq.devices, device) {
+    if (device->store_id != r->device) {
+      continue;
+    }
+    for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+      sensor_value_t* svalue = &device->sensor_values[i];
+      if (svalue->store_key != r->key) {
+        continue;
+      }
+
+      if (r->time > svalue->last_appended) {
+        airq_history_add(&svalue->history, r->time, r->value);
+        airq_aggregate_add(svalue, r->time, r->value);
+        svalue->last_appended = r->time;
+      }
+      if (r->time >= svalue->last_query) {
+        svalue->value = svalue->last_value = svalue->reference = r->value;
+        svalue->last_query = r->time;
+        svalue->restored = true;
+      }
+    }
+  }
+}
+
+/* find the newest record and replay all valid ones starting with the oldest */
+static void store_replay() {
+  uint32_t valid = 0;
+  bool found = false;
+
+  for (uint32_t i = 0; i < capacity; i++) {
+    const store_record_t* r = &records[i];
+    if (r->crc != record_crc(r)) {
+      continue;
+    }
+    if (!found || r->seq > seq) {
+      seq = r->seq;
+      head = i + 1 == capacity ? 0 : i + 1;
+      found = true;
+    }
+    valid++;
+  }
+
+  for (uint32_t n = 0; n < capacity && found; n++) {
+    const store_record_t* r = &records[(head + n) % capacity];
+    if (r->crc == record_crc(r)) {
+      store_replay_record(r);
+    }
+  }
+  if (found) {
+    seq++;
+  }
+
+  vdc_report(LOG_NOTICE, "history store: %u of %u records valid\n", valid, capacity);
+}
+
+int airq_store_open() {
+  airq_device_t* device;
+  store_header_t* header;
+  struct stat st;
+  uint32_t sensors = 0;
+
+  crc32_init();
+
+  LL_FOREACH(airq.devices, device) {
+    device->store_id = name_hash(device->id);
+    for (int i = 0; i < MAX_SENSOR_VALUES && device->sensor_values[i].is_active; i++) {
+      device->sensor_values[i].store_key = name_hash(device->sensor_values[i].value_name);
+      sensors++;
+    }
+  }
+  if (sensors == 0 || (g_history_file != NULL && g_history_file[0] == 0)) {
+    return AIRQ_OK;
+  }
+
+  /* without a history the minimal log still brings back the last known values */
+  capacity = sensors * g_history_size;
+  if (g_history_size == 0) {
+    vdc_report(LOG_NOTICE, "history store: history_size = 0, only the last known values are kept\n");
+  }
+  if (capacity < STORE_MIN_RECORDS) {
+    capacity = STORE_MIN_RECORDS;
+  }
+  store_size = sizeof(store_header_t) + (size_t) capacity * sizeof(store_record_t);
+
+  char* path = store_path();
+  if (path == NULL) {
+    return AIRQ_OUT_OF_MEMORY;
+  }
+  store_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (store_fd < 0 || fstat(store_fd, &st) < 0) {
+    vdc_report(LOG_ERR, "history store: cannot open %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+  if ((size_t) st.st_size != store_size && ftruncate(store_fd, store_size) < 0) {
+    vdc_report(LOG_ERR, "history store: cannot resize %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+  store_map = mmap(NULL, store_size, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+  if (store_map == MAP_FAILED) {
+    store_map = NULL;
+    vdc_report(LOG_ERR, "history store: cannot map %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  header = store_map;
+  records = (store_record_t*) ((char*) store_map + sizeof(store_header_t));
+
+  if (header_valid(header)) {
+    store_replay();
+  } else {
+    if (st.st_size == 0) {
+      vdc_report(LOG_NOTICE, "history store: initializing %s with %u records\n", path, capacity);
+    } else if (header_intact(header) && header->record_size == sizeof(store_record_t)) {
+      vdc_report(LOG_WARNING, "history store: %s holds %u records, %u sensors with history_size %u need %u, "
+          "dropping the stored history\n", path, header->records, sensors, g_history_size, capacity);
+    } else {
+      vdc_report(LOG_WARNING, "history store: %s has no valid header, dropping its content\n", path);
+    }
+    memset(records, 0, (size_t) capacity * sizeof(store_record_t));
+    header_write(header);
+    msync(store_map, store_size, MS_ASYNC);
+  }
+  synced = head;
+
+  /* make the restored values visible before the first poll */
+  LL_FOREACH(airq.devices, device) {
+    airq_snapshot_publish(device);
+  }
+
+  free(path);
+  return AIRQ_OK;
+
+fail:
+  if (store_fd >= 0) {
+    close(store_fd);
+    store_fd = -1;
+  }
+  free(path);
+  return AIRQ_BAD_CONFIG;
+}
+
+/* write one sample, called by the network thread */
+void airq_store_append(airq_device_t* device, sensor_value_t* svalue, time_t time, double value) {
+  if (records == NULL) {
+    return;
+  }
+
+  store_record_t* r = &records[head];
+  r->device = device->store_id;
+  r->key = svalue->store_key;
+  r->seq = seq++;
+  r->time = time;
+  r->value = value;
+  r->crc = record_crc(r);
+
+  if (++head == capacity) {
+    head = 0;
+  }
+}
+
+/* schedule the pages of records [from, to) for writeback */
+static void store_sync_range(uint32_t from, uint32_t to) {
+  size_t start = sizeof(store_header_t) + (size_t) from * sizeof(store_record_t);
+  size_t end = sizeof(store_header_t) + (size_t) to * sizeof(store_record_t);
+
+  start -= start % page_size;
+  msync((char*) store_map + start, end - start, MS_ASYNC);
+}
+
+/*
+ * schedule the records written since the last call for writeback, the page cache
+ * survives a crash of the daemon anyway. A poll appends far less than the
+ * capacity, so the head never laps the last synced position.
+ */
+void airq_store_sync() {
+  if (store_map == NULL || head == synced) {
+    return;
+  }
+  if (head > synced) {
+    store_sync_range(synced, head);
+  } else {
+    store_sync_range(synced, capacity);
+    store_sync_range(0, head);
+  }
+  synced = head;
+}
+
+void airq_store_close() {
+  if (store_map != NULL) {
+    msync(store_map, store_size, MS_SYNC);
+    munmap(store_map, store_size);
+    store_map = NULL;
+    records = NULL;
+  }
+  if (store_fd >= 0) {
+    close(store_fd);
+    store_fd = -1;
+  }
+}
@@ -11,6 +11,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 #include <string.h>
 #include <pthread.h>
 #include <inttypes.h>
@@ -18,11 +19,54 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
 
-static pthread_mutex_t reportMutex;
-static int debugLevel = LOG_WARNING;
-static void printMessage(char *buf);
+/*
+ * Logging: vdc_report() formats the message on the caller's stack and copies
+ * it with its timestamp into a ring owned by the calling thread. A writer
+ * thread drains all rings in timestamp order, escapes the messages and
+ * writes them to stderr in batches. Callers never wait for a lock or for
+ * stderr; when a ring is full the message is dropped and counted, the writer
+ * reports the number of lost messages.
+ */
+
+#define LOG_RING_SIZE (64 * 1024)         /* bytes per thread, a power of two */
+#define LOG_FLUSH_MS 100
+#define LOG_OUT_SIZE (4 * BUFSIZ + 64)
+
+typedef struct log_record {
+  struct timeval time;
+  uint32_t len;
+} log_record_t;
+
+/* single producer (the owning thread), single consumer (the writer thread) */
+typedef struct log_ring {
+  struct log_ring* next;
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_ulong dropped;
+  unsigned long dropped_reported;     /* writer thread only */
+  char data[LOG_RING_SIZE];
+} log_ring_t;
+
+static pthread_mutex_t reportMutex;   /* serializes direct output while the writer is not running */
+int g_debug_level = LOG_WARNING;
+
+static __thread log_ring_t* thread_ring;
+static _Atomic(log_ring_t*) rings = NULL;
+static atomic_bool writer_running = false;
+static atomic_bool writer_stop = false;
+static pthread_t writer_thread;
+static int writer_wakeup = -1;
+
+/* writer thread state */
+static char out[LOG_OUT_SIZE];
+static size_t out_len;
+static time_t ts_second = -1;
+static char ts_text[30];
 
 static double get_timestamp(void) {
   struct timeval tv;
@@ -31,62 +75,225 @@ static double get_timestamp(void) {
   return (tv.tv_sec + tv.tv_usec*1e-6);
 }
 
+double vdc_monotonic_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static void ring_put(log_ring_t* r, size_t pos, const void* data, size_t len) {
+  size_t i = pos & (LOG_RING_SIZE - 1);
+  size_t first = len < LOG_RING_SIZE - i ? len : LOG_RING_SIZE - i;
+
+  memcpy(r->data + i, data, first);
+  memcpy(r->data, (const char*) data + first, len - first);
+}
+
+static void ring_get(const log_ring_t* r, size_t pos, void* data, size_t len) {
+  size_t i = pos & (LOG_RING_SIZE - 1);
+  size_t first = len < LOG_RING_SIZE - i ? len : LOG_RING_SIZE - i;
+
+  memcpy(data, r->data + i, first);
+  memcpy((char*) data + first, r->data, len - first);
+}
+
+/* the ring of the calling thread, created and registered on its first message */
+static log_ring_t* log_ring() {
+  log_ring_t* r = thread_ring;
+
+  if (r == NULL) {
+    r = calloc(1, sizeof(log_ring_t));
+    if (r == NULL) {
+      return NULL;
+    }
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+    }
+    thread_ring = r;
+  }
+  return r;
+}
+
+static void out_flush() {
+  if (out_len > 0) {
+    (void)fwrite(out, 1, out_len, stderr);
+    (void)fflush(stderr);
+    out_len = 0;
+  }
+}
+
+/* timestamp, prefix and the message with non-printable characters escaped, in one pass */
+static void out_message(const struct timeval* time, const char* msg, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+
+  if (LOG_OUT_SIZE - out_len < 4 * len + 40) {
+    out_flush();
+  }
+  if (time->tv_sec != ts_second) {
+    struct tm tm;
+    strftime(ts_text, sizeof(ts_text), "%Y-%m-%d %H:%M:%S", localtime_r(&time->tv_sec, &tm));
+    ts_second = time->tv_sec;
+  }
+  out_len += snprintf(out + out_len, LOG_OUT_SIZE - out_len, "[%s.%03d] airq: ", ts_text, (int) time->tv_usec / 1000);
+
+  char* p = out + out_len;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = msg[i];
+    if (isprint(c) || (isspace(c) && i + 2 >= len)) {
+      *p++ = c;
+    } else {
+      *p++ = '\\';
+      *p++ = 'x';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    }
+  }
+  out_len = p - out;
+}
+
+static void report_dropped(log_ring_t* r) {
+  unsigned long dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+  char msg[64];
+  struct timeval now;
+
+  if (dropped != r->dropped_reported) {
+    gettimeofday(&now, NULL);
+    int n = snprintf(msg, sizeof(msg), "log: %lu messages dropped\n", dropped - r->dropped_reported);
+    out_message(&now, msg, n);
+    r->dropped_reported = dropped;
+  }
+}
+
+/* write everything the rings hold, merged by timestamp */
+static void log_drain() {
+  static char msg[BUFSIZ];
+
+  while (1) {
+    log_ring_t* oldest = NULL;
+    log_record_t rec, oldest_rec;
+
+    for (log_ring_t* r = atomic_load(&rings); r != NULL; r = r->next) {
+      size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+      if (tail == atomic_load_explicit(&r->head, memory_order_acquire)) {
+        continue;
+      }
+      ring_get(r, tail, &rec, sizeof(rec));
+      if (oldest == NULL || timercmp(&rec.time, &oldest_rec.time, <)) {
+        oldest = r;
+        oldest_rec = rec;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+
+    size_t tail = atomic_load_explicit(&oldest->tail, memory_order_relaxed);
+    ring_get(oldest, tail + sizeof(log_record_t), msg, oldest_rec.len);
+    atomic_store_explicit(&oldest->tail, tail + sizeof(log_record_t) + oldest_rec.len, memory_order_release);
+    out_message(&oldest_rec.time, msg, oldest_rec.len);
+  }
+
+  for (log_ring_t* r = atomic_load(&rings); r != NULL; r = r->next) {
+    report_dropped(r);
+  }
+  out_flush();
+}
+
+static void* log_writer(void* arg __attribute__((unused))) {
+  struct pollfd pfd = { .fd = writer_wakeup, .events = POLLIN };
+  uint64_t count;
+
+  while (!atomic_load(&writer_stop)) {
+    log_drain();
+    if (poll(&pfd, 1, LOG_FLUSH_MS) > 0) {
+      ssize_t ret = read(writer_wakeup, &count, sizeof(count));
+      (void) ret;
+    }
+  }
+  log_drain();
+  return NULL;
+}
+
+/* stop the writer at exit, after it has written what is left */
+static void vdc_stop_report() {
+  uint64_t one = 1;
+
+  if (!atomic_load(&writer_running)) {
+    return;
+  }
+  atomic_store(&writer_stop, true);
+  ssize_t ret = write(writer_wakeup, &one, sizeof(one));
+  (void) ret;
+  pthread_join(writer_thread, NULL);
+  atomic_store(&writer_running, false);
+}
+
 void vdc_init_report() {
   pthread_mutex_init(&reportMutex, NULL);
+
+  writer_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (writer_wakeup < 0 || pthread_create(&writer_thread, NULL, &log_writer, NULL) != 0) {
+    /* messages are written directly then */
+    return;
+  }
+  atomic_store(&writer_running, true);
+  atexit(vdc_stop_report);
 }
 
 void vdc_set_debugLevel(int debug) {
-  debugLevel = debug;
+  g_debug_level = debug;
 }
 
 int vdc_get_debugLevel() {
-  return debugLevel;
+  return g_debug_level;
 }
 
-void vdc_report(int errlevel, const char *fmt, ... ) {
-  if (errlevel <= debugLevel) {
-    char buf[BUFSIZ];
-    va_list ap;
-    pthread_mutex_lock(&reportMutex);
-
-    strncpy(buf, "airq: ", BUFSIZ);
-    va_start(ap, fmt);
-    vsnprintf(buf + strlen(buf), sizeof(buf)-strlen(buf), fmt, ap);
-    va_end(ap);
-
-    printMessage(buf);
+static void report(const char *fmt, va_list ap) {
+  char buf[BUFSIZ];
+  log_record_t rec;
 
-    pthread_mutex_unlock(&reportMutex);
+  gettimeofday(&rec.time, NULL);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  if (n < 0) {
+    return;
   }
-}
+  rec.len = (size_t) n < sizeof(buf) ? (uint32_t) n : sizeof(buf) - 1;
 
-void vdc_report_extraLevel(int errlevel, int maxErrlevel, const char *fmt, ... ) {
-  if (errlevel <= maxErrlevel) {
-    char buf[BUFSIZ];
-    va_list ap;
+  log_ring_t* r = atomic_load(&writer_running) ? log_ring() : NULL;
+  if (r == NULL) {
     pthread_mutex_lock(&reportMutex);
+    out_message(&rec.time, buf, rec.len);
+    out_flush();
+    pthread_mutex_unlock(&reportMutex);
+    return;
+  }
 
-    strncpy(buf, "airq: ", BUFSIZ);
-    va_start(ap, fmt);
-    vsnprintf(buf + strlen(buf), sizeof(buf)-strlen(buf), fmt, ap);
-    va_end(ap);
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  size_t need = sizeof(rec) + rec.len;
+  if (LOG_RING_SIZE - (head - tail) < need) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
 
-    printMessage(buf);
+  ring_put(r, head, &rec, sizeof(rec));
+  ring_put(r, head + sizeof(rec), buf, rec.len);
+  atomic_store_explicit(&r->head, head + need, memory_order_release);
 
-    pthread_mutex_unlock(&reportMutex);
+  /* the writer only needs a nudge if it had caught up, otherwise it picks this up with the rest */
+  if (head == tail) {
+    uint64_t one = 1;
+    ssize_t ret = write(writer_wakeup, &one, sizeof(one));
+    (void) ret;
   }
 }
 
-static void printMessage(char *buf) {
-  char buf2[BUFSIZ], *sp, tsbuf[30];
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  strftime(tsbuf, sizeof(tsbuf), "%Y-%m-%d %H:%M:%S", localtime(&t.tv_sec));
-  (void)snprintf(buf2, BUFSIZ, "[%s.%03d] ", tsbuf, (int)t.tv_usec / 1000);
-  for (sp = buf; *sp != '\0'; sp++)
-    if (isprint(*sp) || (isspace(*sp) && (sp[1]=='\0' || sp[2]=='\0')))
-      (void)snprintf(buf2+strlen(buf2), 2, "%c", *sp);
-    else
-      (void)snprintf(buf2+strlen(buf2), 6, "\\x%02x", (unsigned)*sp);
-  (void)fputs(buf2, stderr);
-}
\ No newline at end of file
+/* backend of the vdc_report() macros, the level has been checked there */
+void vdc_log(const char *fmt, ... ) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  report(fmt, ap);
+  va_end(ap);
+}
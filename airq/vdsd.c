@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <inttypes.h>
 
 #include <libconfig.h>
 #include <curl/curl.h>
@@ -43,9 +44,10 @@ void vdc_ping_cb(dsvdc_t *handle __attribute__((unused)), const char *dsuid, voi
     return;
   }
   
-  if (strcasecmp(dsuid, airq_device->dsuidstring) == 0) {
-      ret = dsvdc_send_pong(handle, airq_device->dsuidstring);
-      vdc_report(LOG_NOTICE, "sent pong for device %s / return code %d\n", dsuid, ret);
+  airq_vdcd_t* vdcd = find_vdcd_by_dsuid(dsuid);
+  if (vdcd != NULL) {
+    ret = dsvdc_send_pong(handle, vdcd->dsuidstring);
+    vdc_report(LOG_NOTICE, "sent pong for device %s / return code %d\n", dsuid, ret);
     return;
   }
   vdc_report(LOG_WARNING, "ping: no matching dsuid %s registered\n", dsuid);
@@ -97,13 +99,17 @@ void vdc_request_generic_cb(dsvdc_t *handle __attribute__((unused)), char *dsuid
   
   vdc_report(LOG_INFO, "received request generic for dsuid %s, method name %s\n", dsuid, method_name);
   
-  if (strcasecmp(airq_device->dsuidstring, dsuid) == 0) {
+  airq_vdcd_t* vdcd = find_vdcd_by_dsuid(dsuid);
+  if (vdcd != NULL) {
   }
 }
 
 void vdc_savescene_cb(dsvdc_t *handle __attribute__((unused)), char **dsuid, size_t n_dsuid, int32_t scene, int32_t *group, int32_t *zone_id, void *userdata) {
   vdc_report(LOG_NOTICE, "save scene %d\n", scene);
-  if (strcasecmp(airq_device->dsuidstring, *dsuid) == 0) {
+  for (size_t n = 0; n < n_dsuid; n++) {
+    airq_vdcd_t* vdcd = find_vdcd_by_dsuid(dsuid[n]);
+    if (vdcd != NULL) {
+    }
   }
 }
   
@@ -113,467 +119,506 @@ void vdc_callscene_cb(dsvdc_t *handle __attribute__((unused)), char **dsuid, siz
          vdc_report(LOG_NOTICE,"received %scall scene for device %s\n", force?"forced ":"", *dsuid);
     } **/
 
-  if (strcasecmp(airq_device->dsuidstring, *dsuid) == 0) {
-    vdc_report(LOG_NOTICE, "called scene: %d\n", scene);
+  for (size_t n = 0; n < n_dsuid; n++) {
+    airq_vdcd_t* vdcd = find_vdcd_by_dsuid(dsuid[n]);
+    if (vdcd != NULL) {
+      vdc_report(LOG_NOTICE, "called scene: %d for device %s\n", scene, vdcd->dsuidstring);
+    }
   }
 }
 
-void vdc_setprop_cb(dsvdc_t *handle, const char *dsuid, dsvdc_property_t *property, const dsvdc_property_t *properties, void *userdata) {
-  (void) userdata;
-  int ret;
-  uint8_t code = DSVDC_ERR_NOT_IMPLEMENTED;
-  size_t i;
-  vdc_report(LOG_INFO, "set property request for dsuid \"%s\"\n", dsuid);
+/*
+ * Property dispatch: airq_property_id() maps a name to its index with the
+ * gperf generated perfect hash, the handler tables below are indexed by it.
+ * The vDC and the vdSDs have a table each, vdcd is NULL for the vDC.
+ */
+typedef void (*getprop_handler_t)(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query);
+typedef uint8_t (*setprop_handler_t)(airq_vdcd_t* vdcd, const dsvdc_property_t* properties, size_t index, bool* changed);
 
-  /*
-   * Properties for the VDC
-   */
-  if (strcasecmp(g_vdc_dsuid, dsuid) == 0) {
-    for (i = 0; i < dsvdc_property_get_num_properties(properties); i++) {
-      char *name;
-      ret = dsvdc_property_get_name(properties, i, &name);
-      if (ret != DSVDC_OK) {
-        vdc_report(LOG_ERR, "setprop_cb: error getting property name\n");
-        code = DSVDC_ERR_MISSING_DATA;
-        break;
-      }
-      if (!name) {
-        vdc_report(LOG_ERR, "setprop_cb: not handling wildcard properties\n");
-        code = DSVDC_ERR_NOT_IMPLEMENTED;
-        break;
-      }
+/* known property without a value */
+static void get_nothing(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+}
 
-      vdc_report(LOG_INFO, "set request for name=\"%s\"\n", name);
+static void get_airq(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "AirQ");
+}
 
-      if (strcmp(name, "zoneID") == 0) {
-        uint64_t zoneID;
-        ret = dsvdc_property_get_uint(properties, i, &zoneID);
-        if (ret != DSVDC_OK) {
-          vdc_report(LOG_ERR, "setprop_cb: error getting property value from property %s\n", name);
-          code = DSVDC_ERR_INVALID_VALUE_TYPE;
-          break;
-        }
-        vdc_report(LOG_NOTICE, "setprop_cb: \"%s\" = %d\n", name, zoneID);
-        g_default_zoneID = zoneID;
-        code = DSVDC_OK;
-      } else {
-        code = DSVDC_ERR_NOT_FOUND;
-        break;
-      }
+static void get_empty_string(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "");
+}
 
-      free(name);
-    }
+static void get_zone_id(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_uint(property, "zoneID", vdcd ? vdcd->device->zoneID : g_default_zoneID);
+}
 
-    if (code == DSVDC_OK) {
-      write_config();
-    }
+static void get_model(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  if (vdcd) {
+    dsvdc_property_add_string(property, name, "AirQ");
+    return;
+  }
 
-    dsvdc_send_set_property_response(handle, property, code);
+  char hostname[HOST_NAME_MAX];
+  gethostname(hostname, HOST_NAME_MAX);
+  char servicename[HOST_NAME_MAX + 32];
+  strcpy(servicename, "AirQ Controller @");
+  strcat(servicename, hostname);
+  dsvdc_property_add_string(property, name, servicename);
+}
+
+static void get_name(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  if (vdcd) {
+    dsvdc_property_add_string(property, name, vdcd->device->name);
     return;
-  } 
-  
-  if (strcasecmp(airq_device->dsuidstring, dsuid) != 0) {	  
-    vdc_report(LOG_WARNING, "set property: unhandled dsuid %s\n", dsuid);
-    dsvdc_property_free(property);
+  }
+
+  char info[256];
+  strcpy(info, "AirQ ");
+  strcat(info, airq.devices->name);
+  dsvdc_property_add_string(property, name, info);
+}
+
+static void get_vdc_guid(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  char info[256];
+  char buffer[32];
+
+  memset(info, 0, sizeof(info));
+  if (strcmp(name, "hardwareGuid") == 0) {
+    strcpy(info, "airq-id:");
+  }
+  snprintf(buffer, sizeof(buffer), "%s", airq.devices->id);
+  strcat(info, buffer);
+  dsvdc_property_add_string(property, name, info);
+}
+
+static void get_vdc_capabilities(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_t *reply;
+
+  if (dsvdc_property_new(&reply) != DSVDC_OK) {
+    vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
     return;
   }
+  dsvdc_property_add_bool(reply, "metering", false);
+  dsvdc_property_add_bool(reply, "dynamicDefinitions", true);
+  dsvdc_property_add_property(property, name, &reply);
+}
 
-  /*
-   * Properties for the VDSD's
-   */
-  pthread_mutex_lock(&g_network_mutex);
-  for (i = 0; i < dsvdc_property_get_num_properties(properties); i++) {
-    char *name;
+static void get_primary_group(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_uint(property, "primaryGroup", 9);
+}
 
-    int ret = dsvdc_property_get_name(properties, i, &name);
-    if (ret != DSVDC_OK) {
-      vdc_report(LOG_ERR, "getprop_cb: error getting property name, abort\n");
-      dsvdc_send_get_property_response(handle, property);
-      pthread_mutex_unlock(&g_network_mutex);
-      return;
+static void get_sensor_descriptions(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_t *reply;
+  char sensorName[64];
+  char sensorIndex[64];
+
+  if (dsvdc_property_new(&reply) != DSVDC_OK) {
+    vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
+    return;
+  }
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && vdcd->device->sensor_values[i].is_active; i++) {
+    sensor_value_t* svalue = &vdcd->device->sensor_values[i];
+    snprintf(sensorName, 64, "%s-%s", vdcd->device->name, svalue->value_name);
+
+    dsvdc_property_t *nProp;
+    if (dsvdc_property_new(&nProp) != DSVDC_OK) {
+      vdc_report(LOG_ERR, "failed to allocate reply property for %s/%s\n", name, sensorName);
+      break;
     }
-    if (!name) {
-      vdc_report(LOG_ERR, "getprop_cb: not yet handling wildcard properties\n");
-      //dsvdc_send_property_response(handle, property);
+    dsvdc_property_add_string(nProp, "name", sensorName);
+    dsvdc_property_add_uint(nProp, "sensorType", svalue->sensor_type);
+    dsvdc_property_add_uint(nProp, "sensorUsage", svalue->sensor_usage);
+    dsvdc_property_add_double(nProp, "aliveSignInterval", svalue->alive_sign_interval);
+
+    snprintf(sensorIndex, 64, "%d", i);
+    dsvdc_property_add_property(reply, sensorIndex, &nProp);
+
+    vdc_report(LOG_INFO, "sensorDescription: dsuid %s sensorIndex %s: %s type %d usage %d\n", vdcd->dsuidstring, sensorIndex, sensorName, svalue->sensor_type, svalue->sensor_usage);
+  }
+
+  dsvdc_property_add_property(property, name, &reply);
+}
+
+static void get_sensor_settings(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_t *reply;
+  char sensorIndex[64];
+
+  if (dsvdc_property_new(&reply) != DSVDC_OK) {
+    vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
+    return;
+  }
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && vdcd->device->sensor_values[i].is_active; i++) {
+    dsvdc_property_t *nProp;
+    if (dsvdc_property_new(&nProp) != DSVDC_OK) {
+      vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
+      break;
+    }
+    dsvdc_property_add_uint(nProp, "group", 8);
+    dsvdc_property_add_double(nProp, "minPushInterval", vdcd->device->sensor_values[i].min_push_interval);
+    dsvdc_property_add_double(nProp, "changesOnlyInterval", vdcd->device->sensor_values[i].changes_only_interval);
+
+    snprintf(sensorIndex, 64, "%d", i);
+    dsvdc_property_add_property(reply, sensorIndex, &nProp);
+  }
+  dsvdc_property_add_property(property, name, &reply);
+
+  vdc_report(LOG_INFO, "sensorSettings: dsuid %s\n", vdcd->dsuidstring);
+}
+
+static void get_sensor_states(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_t *reply;
+
+  if (dsvdc_property_new(&reply) != DSVDC_OK) {
+    vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
+    return;
+  }
+
+  int idx;
+  char* sensorIndex;
+  dsvdc_property_t *sensorRequest;
+  dsvdc_property_get_property_by_index(query, 0, &sensorRequest);
+  if (dsvdc_property_get_name(sensorRequest, 0, &sensorIndex) != DSVDC_OK) {
+    vdc_report(LOG_DEBUG, "sensorStates: no index in request\n");
+    idx = -1;
+  } else {
+    idx = strtol(sensorIndex, NULL, 10);
+  }
+  dsvdc_property_free(sensorRequest);
+
+  time_t now = time(NULL);
+  airq_snapshot_t snapshot;
+  airq_snapshot_read(vdcd->device, &snapshot);
+
+  for (int i = 0; i < MAX_SENSOR_VALUES && vdcd->device->sensor_values[i].is_active; i++) {
+    if (idx >= 0 && idx != i) {
       continue;
     }
-    vdc_report(LOG_NOTICE, "get request name!!=\"%s\"\n", name);
-
-    if (strcmp(name, "zoneID") == 0) {
-      uint64_t zoneID;
-      ret = dsvdc_property_get_uint(properties, i, &zoneID);
-      if (ret != DSVDC_OK) {
-        vdc_report(LOG_ERR, "setprop_cb: error getting property value from property %s\n", name);
-        code = DSVDC_ERR_INVALID_VALUE_TYPE;
-        break;
-      }
-      vdc_report(LOG_NOTICE, "setprop_cb: \"%s\" = %d\n", name, zoneID);
-      airq_device->device->zoneID = zoneID;
-      code = DSVDC_OK;
-    } else {
-      code = DSVDC_OK;
+
+    dsvdc_property_t *nProp;
+    if (dsvdc_property_new(&nProp) != DSVDC_OK) {
+      vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
+      break;
     }
-      
 
-    free(name);
+    dsvdc_property_add_double(nProp, "value", snapshot.values[i].value);
+    dsvdc_property_add_int(nProp, "age", now - snapshot.values[i].last_query);
+    dsvdc_property_add_int(nProp, "error", 0);
+
+    char replyIndex[64];
+    snprintf(replyIndex, 64, "%d", i);
+    dsvdc_property_add_property(reply, replyIndex, &nProp);
   }
-  pthread_mutex_unlock(&g_network_mutex);
+  dsvdc_property_add_property(property, name, &reply);
+}
 
-  dsvdc_send_set_property_response(handle, property, code);
+static void get_type(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "vDSD");
 }
 
-void vdc_getprop_cb(dsvdc_t *handle, const char *dsuid, dsvdc_property_t *property, const dsvdc_property_t *query, void *userdata) {
-  (void) userdata;
-  int ret;
-  size_t i;
-  char *name;
-  
-  vdc_report(LOG_INFO, "get property for dsuid: %s\n", dsuid);
+static void get_model_features(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_t *nProp;
 
-  /*
-   * Properties for the VDC
-   */
-  if (strcasecmp(g_vdc_dsuid, dsuid) == 0) {
-    for (i = 0; i < dsvdc_property_get_num_properties(query); i++) {
-
-      int ret = dsvdc_property_get_name(query, i, &name);
-      if (ret != DSVDC_OK) {
-        vdc_report(LOG_ERR, "getprop_cb: error getting property name, abort\n");
-        dsvdc_send_get_property_response(handle, property);
-        return;
-      }
-      if (!name) {
-        vdc_report(LOG_ERR, "getprop_cb: not yet handling wildcard properties\n");
-        dsvdc_send_get_property_response(handle, property);
-        return;
-      }
-      vdc_report(LOG_NOTICE, "get request name=\"%s\"\n", name);
+  dsvdc_property_new(&nProp);
+  dsvdc_property_add_bool(nProp, "dontcare", false);
+  dsvdc_property_add_bool(nProp, "blink", false);
+  dsvdc_property_add_bool(nProp, "outmode", false);
+  dsvdc_property_add_bool(nProp, "jokerconfig", true);
+  dsvdc_property_add_property(property, name, &nProp);
+}
 
-      if ((strcmp(name, "hardwareGuid") == 0) || (strcmp(name, "displayId") == 0)) {
-        char info[256];
-        char buffer[32];
-        size_t n;
+static void get_model_version(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "0");
+}
 
-        memset(info, 0, sizeof(info));
-        if (strcmp(name, "hardwareGuid") == 0) {
-          strcpy(info, "airq-id:");
-        }
-        sprintf(buffer, "%d", airq.device.id);
-        strcat(info, buffer);
-        dsvdc_property_add_string(property, name, info);
-
-      } else if (strcmp(name, "vendorId") == 0) {
-      } else if (strcmp(name, "oemGuid") == 0) {
-
-      } else if (strcmp(name, "implementationId") == 0) {
-        dsvdc_property_add_string(property, name, "AirQ");
-
-      } else if (strcmp(name, "modelUID") == 0) {
-        dsvdc_property_add_string(property, name, "AirQ");
-
-      } else if (strcmp(name, "modelGuid") == 0) {
-        dsvdc_property_add_string(property, name, "AirQ");
-
-      } else if (strcmp(name, "name") == 0) {
-        char info[256];
-        strcpy(info, "AirQ ");
-        strcat(info, airq.device.name);
-        dsvdc_property_add_string(property, name, info);
-
-      } else if (strcmp(name, "model") == 0) {
-        char hostname[HOST_NAME_MAX];
-        gethostname(hostname, HOST_NAME_MAX);
-        char servicename[HOST_NAME_MAX + 32];
-        strcpy(servicename, "AirQ Controller @");
-        strcat(servicename, hostname);
-        dsvdc_property_add_string(property, name, servicename);
-
-      } else if (strcmp(name, "capabilities") == 0) {
-        dsvdc_property_t *reply;
-        ret = dsvdc_property_new(&reply);
-        if (ret != DSVDC_OK) {
-          vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
-          free(name);
-          continue;
-        }
-        dsvdc_property_add_bool(reply, "metering", false);
-        dsvdc_property_add_bool(reply, "dynamicDefinitions", true);
-        dsvdc_property_add_property(property, name, &reply);
+static void get_vendor_id(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "vendor: airq");
+}
 
-      } else if (strcmp(name, "configURL") == 0) {
+static void get_vendor_guid(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  char info[256];
 
+  strcpy(info, "AirQ vDC ");
+  strcat(info, vdcd->device->id);
+  dsvdc_property_add_string(property, name, info);
+}
 
-      } else if (strcmp(name, "zoneID") == 0) {
-        dsvdc_property_add_uint(property, "zoneID", g_default_zoneID);
+static void get_hardware_version(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "0.0.0");
+}
 
-      /* user properties: user name, client_id, status */
+static void get_device_icon(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  if (strcmp(name, "deviceIcon16") == 0) {
+    dsvdc_property_add_bytes(property, name, gIconStation16Data, gIconStation16Size);
+  } else {
+    dsvdc_property_add_bytes(property, name, gIconStation48Data, gIconStation48Size);
+  }
+}
 
-      }
-      free(name);
-    }
+static void get_device_icon_name(airq_vdcd_t* vdcd, const char* name, dsvdc_property_t* property, const dsvdc_property_t* query) {
+  dsvdc_property_add_string(property, name, "airq-airq-16.png");
+}
 
-    dsvdc_send_get_property_response(handle, property);
-    return;
-  } 
+static const getprop_handler_t vdc_getters[AIRQ_PROP_COUNT] = {
+  [AIRQ_PROP_HARDWARE_GUID] = get_vdc_guid,
+  [AIRQ_PROP_DISPLAY_ID] = get_vdc_guid,
+  [AIRQ_PROP_VENDOR_ID] = get_nothing,
+  [AIRQ_PROP_OEM_GUID] = get_nothing,
+  [AIRQ_PROP_IMPLEMENTATION_ID] = get_airq,
+  [AIRQ_PROP_MODEL_UID] = get_airq,
+  [AIRQ_PROP_MODEL_GUID] = get_airq,
+  [AIRQ_PROP_NAME] = get_name,
+  [AIRQ_PROP_MODEL] = get_model,
+  [AIRQ_PROP_CAPABILITIES] = get_vdc_capabilities,
+  [AIRQ_PROP_CONFIG_URL] = get_nothing,
+  [AIRQ_PROP_ZONE_ID] = get_zone_id
+};
+
+static const getprop_handler_t vdsd_getters[AIRQ_PROP_COUNT] = {
+  [AIRQ_PROP_PRIMARY_GROUP] = get_primary_group,
+  [AIRQ_PROP_ZONE_ID] = get_zone_id,
+  [AIRQ_PROP_BUTTON_INPUT_DESCRIPTIONS] = get_nothing,
+  [AIRQ_PROP_BUTTON_INPUT_SETTINGS] = get_nothing,
+  [AIRQ_PROP_DYNAMIC_ACTION_DESCRIPTIONS] = get_nothing,
+  [AIRQ_PROP_OUTPUT_DESCRIPTION] = get_nothing,
+  [AIRQ_PROP_OUTPUT_SETTINGS] = get_nothing,
+  [AIRQ_PROP_CHANNEL_DESCRIPTIONS] = get_nothing,
+  [AIRQ_PROP_CHANNEL_SETTINGS] = get_nothing,
+  [AIRQ_PROP_CHANNEL_STATES] = get_nothing,
+  [AIRQ_PROP_DEVICE_STATES] = get_nothing,
+  [AIRQ_PROP_DEVICE_PROPERTIES] = get_nothing,
+  [AIRQ_PROP_DEVICE_PROPERTY_DESCRIPTIONS] = get_nothing,
+  [AIRQ_PROP_CUSTOM_ACTIONS] = get_nothing,
+  [AIRQ_PROP_BINARY_INPUT_DESCRIPTIONS] = get_nothing,
+  [AIRQ_PROP_BINARY_INPUT_SETTINGS] = get_nothing,
+  [AIRQ_PROP_BINARY_INPUT_STATES] = get_nothing,
+  [AIRQ_PROP_SENSOR_DESCRIPTIONS] = get_sensor_descriptions,
+  [AIRQ_PROP_SENSOR_SETTINGS] = get_sensor_settings,
+  [AIRQ_PROP_SENSOR_STATES] = get_sensor_states,
+  [AIRQ_PROP_NAME] = get_name,
+  [AIRQ_PROP_TYPE] = get_type,
+  [AIRQ_PROP_MODEL] = get_model,
+  [AIRQ_PROP_MODEL_FEATURES] = get_model_features,
+  [AIRQ_PROP_MODEL_UID] = get_airq,
+  [AIRQ_PROP_MODEL_VERSION] = get_model_version,
+  [AIRQ_PROP_DEVICE_CLASS] = get_nothing,
+  [AIRQ_PROP_DEVICE_CLASS_VERSION] = get_nothing,
+  [AIRQ_PROP_OEM_GUID] = get_nothing,
+  [AIRQ_PROP_OEM_MODEL_GUID] = get_nothing,
+  [AIRQ_PROP_VENDOR_ID] = get_vendor_id,
+  [AIRQ_PROP_VENDOR_NAME] = get_airq,
+  [AIRQ_PROP_VENDOR_GUID] = get_vendor_guid,
+  [AIRQ_PROP_HARDWARE_VERSION] = get_hardware_version,
+  [AIRQ_PROP_CONFIG_URL] = get_empty_string,
+  [AIRQ_PROP_HARDWARE_MODEL_GUID] = get_empty_string,
+  [AIRQ_PROP_DEVICE_ICON16] = get_device_icon,
+  [AIRQ_PROP_DEVICE_ICON48] = get_device_icon,
+  [AIRQ_PROP_DEVICE_ICON_NAME] = get_device_icon_name
+};
+
+/* only the default zone of the vDC is stored in airq.cfg */
+static uint8_t set_zone_id(airq_vdcd_t* vdcd, const dsvdc_property_t *properties, size_t index, bool* changed) {
+  uint64_t zoneID;
+
+  if (dsvdc_property_get_uint(properties, index, &zoneID) != DSVDC_OK) {
+    vdc_report(LOG_ERR, "setprop_cb: error getting property value from property zoneID\n");
+    return DSVDC_ERR_INVALID_VALUE_TYPE;
+  }
+  vdc_report(LOG_NOTICE, "setprop_cb: \"zoneID\" = %" PRIu64 "\n", zoneID);
+  if (vdcd) {
+    vdcd->device->zoneID = zoneID;
+  } else {
+    g_default_zoneID = zoneID;
+    *changed = true;
+  }
+  return DSVDC_OK;
+}
 
-  if (strcasecmp(airq_device->dsuidstring, dsuid) != 0) {	  
-    vdc_report(LOG_WARNING, "get property: unhandled dsuid %s\n", dsuid);
-    dsvdc_property_free(property);
-    return;
+/*
+ * sensorSettings = { "<sensor index>" = { minPushInterval, changesOnlyInterval } }
+ * the device is polled right away, so the push governor applies the new intervals to fresh values
+ */
+static uint8_t set_sensor_settings(airq_vdcd_t* vdcd, const dsvdc_property_t *properties, size_t index, bool* changed) {
+  airq_device_t* device = vdcd->device;
+  dsvdc_property_t *settings;
+  uint8_t code = DSVDC_OK;
+
+  if (dsvdc_property_get_property_by_index(properties, index, &settings) != DSVDC_OK) {
+    return DSVDC_ERR_MISSING_DATA;
   }
 
-  /*
-   * Properties for the VDSD's
-   */
-  pthread_mutex_lock(&g_network_mutex);
-  for (i = 0; i < dsvdc_property_get_num_properties(query); i++) {
+  for (size_t s = 0; s < dsvdc_property_get_num_properties(settings) && code == DSVDC_OK; s++) {
+    dsvdc_property_t *sensor;
+    char *sensorIndex;
 
-    int ret = dsvdc_property_get_name(query, i, &name);
-    if (ret != DSVDC_OK) {
-      vdc_report(LOG_ERR, "getprop_cb: error getting property name, abort\n");
-      dsvdc_send_get_property_response(handle, property);
-      pthread_mutex_unlock(&g_network_mutex);
-      return;
+    if (dsvdc_property_get_name(settings, s, &sensorIndex) != DSVDC_OK || !sensorIndex) {
+      code = DSVDC_ERR_MISSING_DATA;
+      break;
     }
-    if (!name) {
-      vdc_report(LOG_ERR, "getprop_cb: not yet handling wildcard properties\n");
-      //dsvdc_send_property_response(handle, property);
-      continue;
+    int idx = strtol(sensorIndex, NULL, 10);
+    free(sensorIndex);
+    if (idx < 0 || idx >= MAX_SENSOR_VALUES || !device->sensor_values[idx].is_active) {
+      code = DSVDC_ERR_NOT_FOUND;
+      break;
     }
-    vdc_report(LOG_NOTICE, "get request name=\"%s\"\n", name);
+    if (dsvdc_property_get_property_by_index(settings, s, &sensor) != DSVDC_OK) {
+      code = DSVDC_ERR_MISSING_DATA;
+      break;
+    }
+
+    sensor_value_t* svalue = &device->sensor_values[idx];
+    for (size_t k = 0; k < dsvdc_property_get_num_properties(sensor); k++) {
+      char *key;
+      double value;
+      uint64_t uvalue;
 
-    if (strcmp(name, "primaryGroup") == 0) {
-      dsvdc_property_add_uint(property, "primaryGroup", 9);
-    } else if (strcmp(name, "zoneID") == 0) {
-      dsvdc_property_add_uint(property, "zoneID", airq_device->device->zoneID);
-    } else if (strcmp(name, "buttonInputDescriptions") == 0) {
-     
-
-    } else if (strcmp(name, "buttonInputSettings") == 0) {
-      
-    } else if (strcmp(name, "dynamicActionDescriptions") == 0) { 
-
-
-    } else if (strcmp(name, "outputDescription") == 0) {
-
-    } else if (strcmp(name, "outputSettings") == 0) {
-
-    } else if (strcmp(name, "channelDescriptions") == 0) {
-    } else if (strcmp(name, "channelSettings") == 0) {
-    } else if (strcmp(name, "channelStates") == 0) {
-    } else if (strcmp(name, "deviceStates") == 0) {
-      
-    } else if (strcmp(name, "deviceProperties") == 0) {
-      
-    } else if (strcmp(name, "devicePropertyDescriptions") == 0) {
-    
-    } else if (strcmp(name, "customActions") == 0) {
-
-    } else if (strcmp(name, "binaryInputDescriptions") == 0) {      
-        
-    } else if (strcmp(name, "binaryInputSettings") == 0) {      
-      
-    } else if (strcmp(name, "sensorDescriptions") == 0) {
-      dsvdc_property_t *reply;
-      ret = dsvdc_property_new(&reply);
-      if (ret != DSVDC_OK) {
-        vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
-        free(name);
+      if (dsvdc_property_get_name(sensor, k, &key) != DSVDC_OK || !key) {
         continue;
       }
-
-      int i = 0;
-      char sensorName[64];
-      char sensorIndex[64];
-	    
-      while(1) {
-        if (airq_device->device->sensor_values[i].is_active) {
-          vdc_report(LOG_ERR, "************* %d %s\n", i, airq_device->device->sensor_values[i].value_name);
-        
-          snprintf(sensorName, 64, "%s-%s", airq_device->device->name, airq_device->device->sensor_values[i].value_name);
-
-          dsvdc_property_t *nProp;
-          if (dsvdc_property_new(&nProp) != DSVDC_OK) {
-            vdc_report(LOG_ERR, "failed to allocate reply property for %s/%s\n", name, sensorName);
-            break;
-          }
-          dsvdc_property_add_string(nProp, "name", sensorName);
-          dsvdc_property_add_uint(nProp, "sensorType", airq_device->device->sensor_values[i].sensor_type);
-          dsvdc_property_add_uint(nProp, "sensorUsage", airq_device->device->sensor_values[i].sensor_usage);
-          dsvdc_property_add_double(nProp, "aliveSignInterval", 300);
-
-          snprintf(sensorIndex, 64, "%d", i);
-          dsvdc_property_add_property(reply, sensorIndex, &nProp);
-
-          vdc_report(LOG_INFO, "sensorDescription: dsuid %s sensorIndex %s: %s type %d usage %d\n", dsuid, sensorIndex, sensorName, airq_device->device->sensor_values[i].sensor_type, airq_device->device->sensor_values[i].sensor_usage); 
-          
-          i++;
-        } else {
+      if (dsvdc_property_get_double(sensor, k, &value) != DSVDC_OK) {
+        if (dsvdc_property_get_uint(sensor, k, &uvalue) != DSVDC_OK) {
+          vdc_report(LOG_ERR, "setprop_cb: error getting value of sensorSettings.%d.%s\n", idx, key);
+          code = DSVDC_ERR_INVALID_VALUE_TYPE;
+          free(key);
           break;
         }
+        value = uvalue;
       }
 
-		  dsvdc_property_add_property(property, name, &reply);  
-    } else if (strcmp(name, "sensorSettings") == 0) {
-      dsvdc_property_t *reply;
-      ret = dsvdc_property_new(&reply);
-      if (ret != DSVDC_OK) {
-        vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
-        free(name);
-        continue;
+      if (strcmp(key, "minPushInterval") == 0) {
+        svalue->min_push_interval = value;
+      } else if (strcmp(key, "changesOnlyInterval") == 0) {
+        svalue->changes_only_interval = value;
       }
+      vdc_report(LOG_NOTICE, "setprop_cb: sensorSettings.%d.%s = %.1f\n", idx, key, value);
+      free(key);
+    }
+    dsvdc_property_free(sensor);
+  }
 
-      char sensorIndex[64];
-      int i = 0;
-      while (1) {
-        if (airq_device->device->sensor_values[i].is_active) {
-          dsvdc_property_t *nProp;
-          if (dsvdc_property_new(&nProp) != DSVDC_OK) {
-            vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
-            break;
-          }
-          dsvdc_property_add_uint(nProp, "group", 8);
-          dsvdc_property_add_uint(nProp, "minPushInterval", 5);
-          dsvdc_property_add_double(nProp, "changesOnlyInterval", 5);
-
-          snprintf(sensorIndex, 64, "%d", i);
-          dsvdc_property_add_property(reply, sensorIndex, &nProp);
-          
-          i++;
-        } else {
-          break;
-        }
-      }
-      dsvdc_property_add_property(property, name, &reply); 
-      
-      vdc_report(LOG_INFO, "sensorSettings: dsuid %s sensorIndex %s\n", dsuid, sensorIndex); 
-
-    } else if (strcmp(name, "sensorStates") == 0) {
-      dsvdc_property_t *reply;
-      ret = dsvdc_property_new(&reply);
-      if (ret != DSVDC_OK) {
-        vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
-        free(name);
-        continue;
-      }
+  dsvdc_property_free(settings);
+  if (code == DSVDC_OK) {
+    *changed = true;
+    airq_network_poll_now(device);
+  }
+  return code;
+}
 
-      int idx;
-      char* sensorIndex;
-      dsvdc_property_t *sensorRequest;
-      dsvdc_property_get_property_by_index(query, 0, &sensorRequest);
-      if (dsvdc_property_get_name(sensorRequest, 0, &sensorIndex) != DSVDC_OK) {
-        vdc_report(LOG_DEBUG, "sensorStates: no index in request\n");
-        idx = -1;
-      } else {
-        idx = strtol(sensorIndex, NULL, 10);
-      }
-      dsvdc_property_free(sensorRequest);
-
-      time_t now = time(NULL);
-      
-      int i = 0;
-      while (1) {
-        if (airq_device->device->sensor_values[i].is_active) {
-          if (idx >= 0 && idx != i) {
-            i++;
-            continue;
-          }
-
-          dsvdc_property_t *nProp;
-          if (dsvdc_property_new(&nProp) != DSVDC_OK) {
-            vdc_report(LOG_ERR, "failed to allocate reply property for %s\n", name);
-            break;
-          }
-
-          double val = airq_device->device->sensor_values[i].value;
-
-          dsvdc_property_add_double(nProp, "value", val);
-          dsvdc_property_add_int(nProp, "age", now - airq_device->device->sensor_values[i].last_query);
-          dsvdc_property_add_int(nProp, "error", 0);
-
-          char replyIndex[64];
-          snprintf(replyIndex, 64, "%d", i);
-          dsvdc_property_add_property(reply, replyIndex, &nProp);
-          
-          i++;
-        } else {
-          break;
-        }
-      }
-      dsvdc_property_add_property(property, name, &reply);  
+static const setprop_handler_t vdc_setters[AIRQ_PROP_COUNT] = {
+  [AIRQ_PROP_ZONE_ID] = set_zone_id
+};
 
-    } else if (strcmp(name, "binaryInputStates") == 0) {      
+static const setprop_handler_t vdsd_setters[AIRQ_PROP_COUNT] = {
+  [AIRQ_PROP_ZONE_ID] = set_zone_id,
+  [AIRQ_PROP_SENSOR_SETTINGS] = set_sensor_settings
+};
 
-    } else if (strcmp(name, "name") == 0) {
-      dsvdc_property_add_string(property, name, airq_device->device->name);
+void vdc_setprop_cb(dsvdc_t *handle, const char *dsuid, dsvdc_property_t *property, const dsvdc_property_t *properties, void *userdata) {
+  (void) userdata;
+  const setprop_handler_t* setters = vdc_setters;
+  airq_vdcd_t* vdcd = NULL;
+  uint8_t code = DSVDC_ERR_NOT_IMPLEMENTED;
+  bool changed = false;
 
-    } else if (strcmp(name, "type") == 0) {
-      dsvdc_property_add_string(property, name, "vDSD");
+  airq_metrics_count(AIRQ_COUNTER_SETPROP, 1);
+  vdc_report(LOG_INFO, "set property request for dsuid \"%s\"\n", dsuid);
 
-    } else if (strcmp(name, "model") == 0) {
-      char info[256];
-      strcpy(info, "AirQ");
-     
-      dsvdc_property_add_string(property, name, info);
-    } else if (strcmp(name, "modelFeatures") == 0) {
-      dsvdc_property_t *nProp;
-      dsvdc_property_new(&nProp);
-      dsvdc_property_add_bool(nProp, "dontcare", false);
-      dsvdc_property_add_bool(nProp, "blink", false);
-      dsvdc_property_add_bool(nProp, "outmode", false);
-      dsvdc_property_add_bool(nProp, "jokerconfig", true);
-      dsvdc_property_add_property(property, name, &nProp);
-    } else if (strcmp(name, "modelUID") == 0) {      
-      dsvdc_property_add_string(property, name, "AirQ");
+  if (strcasecmp(g_vdc_dsuid, dsuid) != 0) {
+    vdcd = find_vdcd_by_dsuid(dsuid);
+    if (vdcd == NULL) {
+      vdc_report(LOG_WARNING, "set property: unhandled dsuid %s\n", dsuid);
+      dsvdc_property_free(property);
+      return;
+    }
+    setters = vdsd_setters;
+  }
 
-    } else if (strcmp(name, "modelVersion") == 0) {
-      dsvdc_property_add_string(property, name, "0");
+  for (size_t i = 0; i < dsvdc_property_get_num_properties(properties); i++) {
+    char *name;
 
-    } else if (strcmp(name, "deviceClass") == 0) {
-    } else if (strcmp(name, "deviceClassVersion") == 0) {
-    } else if (strcmp(name, "oemGuid") == 0) {
-    } else if (strcmp(name, "oemModelGuid") == 0) {
+    if (dsvdc_property_get_name(properties, i, &name) != DSVDC_OK) {
+      vdc_report(LOG_ERR, "setprop_cb: error getting property name\n");
+      code = DSVDC_ERR_MISSING_DATA;
+      break;
+    }
+    if (!name) {
+      vdc_report(LOG_ERR, "setprop_cb: not handling wildcard properties\n");
+      code = DSVDC_ERR_NOT_IMPLEMENTED;
+      break;
+    }
+    vdc_report(LOG_INFO, "set request for name=\"%s\"\n", name);
 
-    } else if (strcmp(name, "vendorId") == 0) {
-      dsvdc_property_add_string(property, name, "vendor: airq");
+    int id = airq_property_id(name);
+    if (id >= 0 && setters[id] != NULL) {
+      code = setters[id](vdcd, properties, i, &changed);
+    } else if (vdcd == NULL) {
+      code = DSVDC_ERR_NOT_FOUND;
+    } else {
+      code = DSVDC_OK;            /* read-only properties of a vdSD are ignored */
+    }
+    free(name);
 
-    } else if (strcmp(name, "vendorName") == 0) {
-      dsvdc_property_add_string(property, name, "AirQ");
+    if (code != DSVDC_OK) {
+      break;
+    }
+  }
 
-    } else if (strcmp(name, "vendorGuid") == 0) {
-      char info[256];
-      strcpy(info, "AirQ vDC ");
-      strcat(info, airq_device->device->id);
-      dsvdc_property_add_string(property, name, info);
+  if (changed) {
+    write_config();
+  }
 
-    } else if (strcmp(name, "hardwareVersion") == 0) {
-      dsvdc_property_add_string(property, name, "0.0.0");
+  dsvdc_send_set_property_response(handle, property, code);
+}
 
-    } else if (strcmp(name, "configURL") == 0) {
-      dsvdc_property_add_string(property, name, "");
+static void getprop(dsvdc_t *handle, const char *dsuid, dsvdc_property_t *property, const dsvdc_property_t *query) {
+  const getprop_handler_t* getters = vdc_getters;
+  airq_vdcd_t* vdcd = NULL;
 
-    } else if (strcmp(name, "hardwareModelGuid") == 0) {
-      dsvdc_property_add_string(property, name, "");
+  vdc_report(LOG_INFO, "get property for dsuid: %s\n", dsuid);
 
-    } else if (strcmp(name, "deviceIcon16") == 0) {
-        dsvdc_property_add_bytes(property, name, gIconStation16Data, gIconStation16Size);
+  if (strcasecmp(g_vdc_dsuid, dsuid) != 0) {
+    vdcd = find_vdcd_by_dsuid(dsuid);
+    if (vdcd == NULL) {
+      vdc_report(LOG_WARNING, "get property: unhandled dsuid %s\n", dsuid);
+      dsvdc_property_free(property);
+      return;
+    }
+    getters = vdsd_getters;
+  }
 
-    } else if (strcmp(name, "deviceIcon48") == 0) {
-        dsvdc_property_add_bytes(property, name, gIconStation48Data, gIconStation48Size);
+  for (size_t i = 0; i < dsvdc_property_get_num_properties(query); i++) {
+    char *name;
 
-    } else if (strcmp(name, "deviceIconName") == 0) {
-      char info[256];
-      strcpy(info, "airq-airq-16.png");
-      
-      dsvdc_property_add_string(property, name, info);
+    if (dsvdc_property_get_name(query, i, &name) != DSVDC_OK) {
+      vdc_report(LOG_ERR, "getprop_cb: error getting property name, abort\n");
+      break;
+    }
+    int id = airq_property_dispatch(name, vdcd == NULL);
+    if (!name) {
+      vdc_report(LOG_ERR, "getprop_cb: not yet handling wildcard properties\n");
+      if (id == AIRQ_PROP_STOP) {
+        break;
+      }
+      continue;
+    }
+    vdc_report(LOG_NOTICE, "get request name=\"%s\"\n", name);
 
+    if (id >= 0 && getters[id] != NULL) {
+      getters[id](vdcd, name, property, query);
     } else {
       vdc_report(LOG_WARNING, "get property handler: unhandled name=\"%s\"\n", name);
     }
-
     free(name);
   }
 
-  pthread_mutex_unlock(&g_network_mutex);
   dsvdc_send_get_property_response(handle, property);
 }
+
+void vdc_getprop_cb(dsvdc_t *handle, const char *dsuid, dsvdc_property_t *property, const dsvdc_property_t *query, void *userdata) {
+  (void) userdata;
+  double start = vdc_monotonic_ms();
+
+  getprop(handle, dsuid, property, query);
+  airq_metrics_count(AIRQ_COUNTER_GETPROP, 1);
+  airq_metrics_observe(AIRQ_STAGE_GETPROP, vdc_monotonic_ms() - start);
+}